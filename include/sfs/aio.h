@@ -0,0 +1,34 @@
+// aio.h: Asynchronous block I/O queue
+
+#pragma once
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+class IOQueue {
+public:
+    // Default number of requests kept in flight
+    const static size_t DEFAULT_DEPTH = 64;
+
+    virtual ~IOQueue() {}
+
+    // Queue transfer of length bytes between data and fd at offset
+    // (data must stay valid until wait returns)
+    // @param	fd	    File descriptor to transfer to or from
+    // @param	write	    Whether to write (true) or read (false)
+    // @param	data	    Buffer to transfer
+    // @param	length	    Number of bytes to transfer
+    // @param	offset	    File offset to transfer at
+    virtual void submit(int fd, bool write, char *data, size_t length, off_t offset) = 0;
+
+    // Wait for all queued transfers
+    // Returns false (with errno set) if any of them failed.
+    virtual bool wait() = 0;
+
+    // Return name of the queue implementation
+    virtual const char *name() const = 0;
+
+    // Create an io_uring queue, or a thread-pool queue if io_uring is unavailable
+    // @param	depth	    Number of requests kept in flight
+    static IOQueue *create(size_t depth = DEFAULT_DEPTH);
+};
@@ -0,0 +1,63 @@
+// bitmap.h: Packed bitmap
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+class Bitmap {
+private:
+    uint64_t *Words;	    // Packed bits, 64 per word
+    size_t    Bits;	    // Number of bits in bitmap
+    size_t    Set;	    // Number of set bits
+
+    const static size_t WORD_BITS = 64;
+
+    // Return index of first bit in [from, to) equal to value, -1 if none
+    ssize_t find(size_t from, size_t to, bool value) const;
+
+public:
+    // Constructor (all bits clear)
+    // @param	bits	    Number of bits in bitmap
+    Bitmap(size_t bits = 0);
+
+    // Destructor
+    ~Bitmap();
+
+    // Resize bitmap and clear all bits
+    // @param	bits	    Number of bits in bitmap
+    void reset(size_t bits);
+
+    // Return number of bits in bitmap
+    size_t size() const { return Bits; }
+
+    // Return number of set bits
+    size_t count() const { return Set; }
+
+    // Return number of 64-bit words holding the bits
+    size_t words() const { return (Bits + WORD_BITS - 1) / WORD_BITS; }
+
+    // Copy all bits out to or in from words() packed words
+    void save(uint64_t *words) const;
+    void load(const uint64_t *words);
+
+    // Set every bit that is set in other (of the same size)
+    void merge(const Bitmap &other);
+
+    // Return whether or not bit is set
+    bool test(size_t bit) const { return (Words[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1; }
+
+    // Set or clear a single bit
+    void set(size_t bit);
+    void clear(size_t bit);
+
+    // Return first clear bit in [from, to), -1 if none
+    ssize_t find_clear(size_t from, size_t to) const { return find(from, to, false); }
+
+    // Return first set bit in [from, to), -1 if none
+    ssize_t find_set(size_t from, size_t to) const { return find(from, to, true); }
+
+private:
+    Bitmap(const Bitmap &);
+    Bitmap &operator=(const Bitmap &);
+};
@@ -0,0 +1,188 @@
+// cache.h: Write-back block cache
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+// All operations are thread-safe. Runs of uncached blocks are transferred
+// without holding the cache lock, so callers must not read and write the
+// same block concurrently (FileSystem guarantees this with inode locks).
+class BlockCache {
+private:
+    struct Entry {
+    	ssize_t	BlockNumber;	    // Block held by this entry (-1 if unused)
+    	bool	Dirty;		    // Whether or not data differs from disk
+    	bool	Prefetched;	    // Read ahead and not used since
+    	bool	Pinned;		    // Changed since the last journal commit (kept out of place)
+    	bool	Committing;	    // Being logged by a journal commit (kept out of place)
+    	char   *Data;		    // Cached block contents
+    	Entry  *Prev;		    // More recently used neighbour
+    	Entry  *Next;		    // Less recently used neighbour
+    };
+
+    Disk   *disk;		    // Backing disk
+    size_t  Capacity;		    // Number of cached blocks
+    Entry  *Entries;		    // Entry storage
+    char   *Buffer;		    // Block storage for all entries
+    Entry  *Head;		    // Most recently used entry
+    Entry  *Tail;		    // Least recently used entry
+    std::unordered_map<size_t, Entry *> Index; // Block number -> entry
+    std::mutex Lock;		    // Protects entries, LRU list and index
+    std::condition_variable_any Released; // Signaled when a commit gives its blocks back
+
+    // Counters are updated under Lock and read without it
+    std::atomic<size_t> Hits;	    // Number of lookups served from memory
+    std::atomic<size_t> Misses;	    // Number of lookups that went to disk
+    std::atomic<size_t> Evictions;  // Number of entries recycled
+    std::atomic<size_t> Writebacks; // Number of dirty blocks written to disk
+    std::atomic<size_t> Prefetches; // Number of blocks read ahead
+    std::atomic<size_t> ReadaheadHits;	 // Number of read-ahead blocks used before eviction
+    std::atomic<size_t> ReadaheadWasted; // Number of read-ahead blocks evicted unused
+    std::atomic<size_t> PinnedCount; // Number of pinned entries
+    std::atomic<size_t> Stalls;	    // Number of lookups that waited for a commit to free an entry
+
+    // Move entry to the front of the LRU list
+    void touch(Entry *entry);
+
+    // Unlink entry from the LRU list
+    void unlink(Entry *entry);
+
+    // Count a lookup served by entry and move it to the front of the LRU list
+    void hit(Entry *entry);
+
+    // Unindex the least recently used entry that is not held for the journal,
+    // writing its block back if dirty, and return it unused (NULL if every
+    // entry is held)
+    Entry *recycle();
+
+    // Return whether or not a journal commit holds any entry
+    bool committing() const;
+
+    // Return entry holding blocknum, recycling the LRU entry on a miss (after
+    // the commit in flight gives its blocks back if every entry is held)
+    // @param	blocknum    Block to look up
+    // @param	fill	    Whether or not to read block from disk on a miss
+    Entry *lookup(size_t blocknum, bool fill);
+
+    struct Run {
+    	size_t	BlockNumber;	    // First block of run
+    	size_t	Count;		    // Number of blocks in run
+    	char   *Data;		    // Buffer of run
+    };
+
+    // Copy cached blocks between data and the cache, collecting runs of misses
+    // @param	blocknum    First block
+    // @param	count	    Number of blocks
+    // @param	data	    Buffer of count blocks
+    // @param	write	    Whether to copy into the cache (true) or out of it (false)
+    // @param	misses	    Runs of uncached blocks
+    void transfer_cached(size_t blocknum, size_t count, char *data, bool write, std::vector<Run> &misses);
+
+public:
+    // Number of blocks cached when no size is given
+    const static size_t DEFAULT_CAPACITY = 1024;
+
+    // Constructor
+    // @param	disk	    Disk to cache
+    // @param	capacity    Number of blocks to keep in memory
+    BlockCache(Disk *disk, size_t capacity = DEFAULT_CAPACITY);
+
+    // Destructor (writes back dirty blocks)
+    ~BlockCache();
+
+    // Copy part of a block out of the cache (or straight out of the mapping)
+    // @param	blocknum    Block to read from
+    // @param	offset	    Byte offset within the block
+    // @param	length	    Number of bytes to read
+    // @param	data	    Buffer to read into
+    void read_range(size_t blocknum, size_t offset, size_t length, char *data);
+
+    // Update part of a cached block in place and mark it dirty
+    // @param	blocknum    Block to update
+    // @param	offset	    Byte offset within the block
+    // @param	length	    Number of bytes to write
+    // @param	data	    Buffer to write from
+    // @param	zero	    Zero-fill the rest of the block instead of reading it
+    void write_range(size_t blocknum, size_t offset, size_t length, const char *data, bool zero = false);
+
+    // Read contiguous blocks; runs of uncached blocks are queued on the disk
+    // as one request straight into data and are not added to the cache
+    // (data is only complete once wait returns)
+    // @param	blocknum    First block to read from
+    // @param	count	    Number of blocks to read
+    // @param	data	    Buffer of count blocks to read into
+    void read_blocks(size_t blocknum, size_t count, char *data);
+
+    // Write contiguous blocks; cached blocks are updated in place and runs
+    // of uncached blocks are queued on the disk as one write-through request
+    // (data must stay untouched until wait returns)
+    // @param	blocknum    First block to write to
+    // @param	count	    Number of blocks to write
+    // @param	data	    Buffer of count blocks to write from
+    void write_blocks(size_t blocknum, size_t count, char *data);
+
+    // Wait for the requests queued by read_blocks and write_blocks
+    void wait();
+
+    // Cache a clean copy of a block just read from disk, but only if an
+    // unused entry is left (never evicts; no-op if the block is cached)
+    // @param	blocknum    Block that was read
+    // @param	data	    Contents of the block
+    void insert(size_t blocknum, const char *data);
+
+    // Read uncached blocks of a run into the cache as one request per
+    // sub-run, queued behind any requests of the caller that are still in
+    // flight; waits for the disk and evicts the LRU entries to make room
+    // @param	blocknum    First block to read ahead
+    // @param	count	    Number of blocks to read ahead
+    void prefetch(size_t blocknum, size_t count);
+
+    // Update part of a block like write_range, but pin it: it is not written
+    // back in place until a journal commit has collected and logged it (the
+    // caller keeps at most half of the entries pinned, so lookups only ever
+    // wait for a commit in flight)
+    // @param	blocknum    Block to update
+    // @param	offset	    Byte offset within the block
+    // @param	length	    Number of bytes to write
+    // @param	data	    Buffer to write from
+    void write_pinned(size_t blocknum, size_t offset, size_t length, const char *data);
+
+    // Unpin every pinned block, appending its number to blocks and its
+    // contents to images; the blocks stay out of place until release
+    // @param	blocks	    Numbers of the collected blocks
+    // @param	images	    Contents of the collected blocks, one after another
+    void collect(std::vector<size_t> &blocks, std::vector<char> &images);
+
+    // Let the blocks of the last collect be written back in place
+    void release();
+
+    // Return whether or not a block is held for the journal (pinned or being committed)
+    // @param	blocknum    Block to check
+    bool held(size_t blocknum);
+
+    // Write all dirty blocks back to disk (except those held for the journal)
+    void flush();
+
+    // Restart the hit, miss, eviction, writeback, read-ahead and stall counts from zero
+    void reset_stats();
+
+    // Return statistics
+    size_t capacity()	const { return Capacity; }
+    size_t hits()	const { return Hits.load(std::memory_order_relaxed); }
+    size_t misses()	const { return Misses.load(std::memory_order_relaxed); }
+    size_t evictions()	const { return Evictions.load(std::memory_order_relaxed); }
+    size_t writebacks()	const { return Writebacks.load(std::memory_order_relaxed); }
+    size_t prefetches()	const { return Prefetches.load(std::memory_order_relaxed); }
+    size_t readahead_hits()	const { return ReadaheadHits.load(std::memory_order_relaxed); }
+    size_t readahead_wasted()	const { return ReadaheadWasted.load(std::memory_order_relaxed); }
+    size_t pinned()	const { return PinnedCount.load(std::memory_order_relaxed); }
+    size_t stalls()	const { return Stalls.load(std::memory_order_relaxed); }
+};
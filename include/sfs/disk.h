@@ -2,41 +2,100 @@
 
 #pragma once
 
+#include "sfs/aio.h"
+
+#include <atomic>
+#include <mutex>
+
 #include <stdlib.h>
 
+class LatencyDisk;
+
+// Block device. The public block operations check their arguments, count
+// the blocks and record statistics, then hand the request to the transfer
+// hooks of an implementation (FileDisk, RamDisk or LatencyDisk).
+// Block I/O may be issued from several threads at once; open and the
+// destructor must not run concurrently with anything else.
 class Disk {
 private:
-    int	    FileDescriptor; // File descriptor of disk image
-    size_t  Blocks;	    // Number of blocks in disk image
-    size_t  Reads;	    // Number of reads performed
-    size_t  Writes;	    // Number of writes performed
+    std::atomic<size_t> Reads;  // Number of reads performed
+    std::atomic<size_t> Writes; // Number of writes performed
     size_t  Mounts;	    // Number of mounts
+    bool    Wrapped;	    // Whether or not another disk reports for this one
+
+protected:
+    size_t  Blocks;	    // Number of blocks in disk image
 
     // Check parameters
     // @param	blocknum    Block to operate on
     // @param	data	    Buffer to operate on
     // Throws invalid_argument exception on error.
-    void sanity_check(int blocknum, char *data);
+    void sanity_check(size_t blocknum, const char *data);
+
+    // Check that a run of blocks lies on the disk
+    // @param	blocknum    First block of run
+    // @param	count	    Number of blocks in run
+    // Throws invalid_argument exception on error.
+    void sanity_check_run(size_t blocknum, size_t count);
+
+    // Transfer contiguous blocks to or from one buffer (arguments already checked)
+    // @param	blocknum    First block
+    // @param	count	    Number of blocks
+    // @param	data	    Buffer of count blocks
+    // @param	write	    Whether to write (true) or read (false)
+    // Throws runtime_error exception on error.
+    virtual void transfer_blocks(size_t blocknum, size_t count, char *data, bool write) = 0;
+
+    // Transfer contiguous blocks to or from one buffer per block (one block at a time by default)
+    // @param	blocknum    First block
+    // @param	count	    Number of blocks
+    // @param	buffers	    Array of count block buffers
+    // @param	write	    Whether to write (true) or read (false)
+    virtual void transfer_vector(size_t blocknum, size_t count, char **buffers, bool write);
+
+    // Queue a transfer of contiguous blocks (completed at once by default)
+    // @param	blocknum    First block
+    // @param	count	    Number of blocks
+    // @param	data	    Buffer of count blocks
+    // @param	write	    Whether to write (true) or read (false)
+    virtual void submit_blocks(size_t blocknum, size_t count, char *data, bool write);
+
+    // Return block in place in memory (NULL by default)
+    // @param	blocknum    Block to look at (already checked)
+    virtual const char *map_block(size_t blocknum);
+
+    friend class LatencyDisk;
 
 public:
     // Number of bytes per block
     const static size_t BLOCK_SIZE = 4096;
     
     // Default constructor
-    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0) {}
+    Disk() : Reads(0), Writes(0), Mounts(0), Wrapped(false), Blocks(0) {}
     
-    // Destructor
-    ~Disk();
+    // Destructor (prints the number of block reads and writes)
+    virtual ~Disk();
 
-    // Open disk image
+    // Create and open a disk
+    // @param	backend	    file, mmap or async (FileDisk), ram (RamDisk), ssd or hdd (LatencyDisk over RamDisk)
     // @param	path	    Path to disk image
     // @param	nblocks	    Number of blocks in disk image
-    // Throws runtime_error exception on error.
-    void open(const char *path, size_t nblocks);
+    // Returns NULL if the backend is unknown; throws runtime_error exception if the disk cannot be opened.
+    static Disk *create(const char *backend, const char *path, size_t nblocks);
+
+    // Return name of the backend in use
+    virtual const char *name() const = 0;
 
     // Return size of disk (in terms of blocks)
     size_t size() const { return Blocks; }
 
+    // Return number of block reads and writes performed so far
+    size_t reads()  const { return Reads; }
+    size_t writes() const { return Writes; }
+
+    // Return whether or not view returns blocks in place
+    virtual bool mapped() const { return false; }
+
     // Return whether or not disk is mounted
     bool mounted() const { return Mounts > 0; }
 
@@ -49,10 +108,123 @@ public:
     // Read block from disk
     // @param	blocknum    Block to read from
     // @param	data	    Buffer to read into
-    void read(int blocknum, char *data);
+    void read(size_t blocknum, char *data);
     
     // Write block to disk
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
-    void write(int blocknum, char *data);
+    void write(size_t blocknum, char *data);
+
+    // Read contiguous blocks from disk with a single request
+    // @param	blocknum    First block to read from
+    // @param	count	    Number of blocks to read
+    // @param	data	    Buffer of count blocks to read into
+    void read_blocks(size_t blocknum, size_t count, char *data);
+
+    // Write contiguous blocks to disk with a single request
+    // @param	blocknum    First block to write to
+    // @param	count	    Number of blocks to write
+    // @param	data	    Buffer of count blocks to write from
+    void write_blocks(size_t blocknum, size_t count, char *data);
+
+    // Read contiguous blocks into separate buffers (one per block)
+    // @param	blocknum    First block to read from
+    // @param	count	    Number of blocks to read
+    // @param	buffers	    Array of count block buffers to read into
+    void readv(size_t blocknum, size_t count, char **buffers);
+
+    // Write contiguous blocks from separate buffers (one per block)
+    // @param	blocknum    First block to write to
+    // @param	count	    Number of blocks to write
+    // @param	buffers	    Array of count block buffers to write from
+    void writev(size_t blocknum, size_t count, char **buffers);
+
+    // Queue read of contiguous blocks (completed synchronously unless the disk queues requests)
+    // (data must stay valid and untouched until wait returns)
+    // @param	blocknum    First block to read from
+    // @param	count	    Number of blocks to read
+    // @param	data	    Buffer of count blocks to read into
+    void submit_read(size_t blocknum, size_t count, char *data);
+
+    // Queue write of contiguous blocks (completed synchronously unless the disk queues requests)
+    // (data must stay valid and untouched until wait returns)
+    // @param	blocknum    First block to write to
+    // @param	count	    Number of blocks to write
+    // @param	data	    Buffer of count blocks to write from
+    void submit_write(size_t blocknum, size_t count, char *data);
+
+    // Wait for all queued requests (including those of other threads)
+    // Throws runtime_error exception if any of them failed.
+    virtual void wait() {}
+
+    // Zero blocks without writing them: punch a hole, zero the range in the
+    // file system or cut off the end of the image (not counted as writes)
+    // @param	blocknum    First block to zero
+    // @param	count	    Number of blocks to zero
+    // Returns false if the image cannot zero the range that way.
+    virtual bool discard(size_t blocknum, size_t count);
+
+    // Zero blocks, writing zero blocks only if they cannot be discarded
+    // @param	blocknum    First block to zero
+    // @param	count	    Number of blocks to zero
+    void zero(size_t blocknum, size_t count);
+
+    // Return block in place in memory (counts as a read)
+    // @param	blocknum    Block to view
+    // Returns NULL if the disk is not mapped.
+    const char *view(size_t blocknum);
+
+    // Flush written blocks to stable storage
+    // Throws runtime_error exception on error.
+    virtual void sync() = 0;
+};
+
+// Disk image file
+class FileDisk : public Disk {
+public:
+    // I/O backends
+    enum Backend {
+    	FILE_IO,	    // pread/pwrite on the image file descriptor
+    	MMAP_IO,	    // memcpy to and from a shared mapping of the image
+    	ASYNC_IO,	    // queued requests completed by io_uring or a thread pool
+    };
+
+private:
+    int	    FileDescriptor; // File descriptor of disk image
+    Backend IOBackend;	    // Backend in use
+    char   *Mapping;	    // Mapping of disk image (MMAP_IO only)
+    IOQueue *Queue;	    // Request queue (ASYNC_IO only)
+    std::mutex QueueLock;   // Serializes access to Queue
+
+protected:
+    void transfer_blocks(size_t blocknum, size_t count, char *data, bool write);
+    void transfer_vector(size_t blocknum, size_t count, char **buffers, bool write);
+    void submit_blocks(size_t blocknum, size_t count, char *data, bool write);
+    const char *map_block(size_t blocknum);
+
+public:
+    // Default constructor
+    FileDisk() : FileDescriptor(0), IOBackend(FILE_IO), Mapping(NULL), Queue(NULL) {}
+
+    // Destructor
+    ~FileDisk();
+
+    // Open disk image
+    // @param	path	    Path to disk image
+    // @param	nblocks	    Number of blocks in disk image
+    // @param	backend	    I/O backend (MMAP_IO falls back to FILE_IO if the image cannot be mapped)
+    // @param	depth	    Number of requests kept in flight (ASYNC_IO only)
+    // Throws runtime_error exception on error.
+    void open(const char *path, size_t nblocks, Backend backend = FILE_IO, size_t depth = IOQueue::DEFAULT_DEPTH);
+
+    // Return backend in use
+    Backend backend() const { return IOBackend; }
+
+    const char *name() const;
+    bool mapped() const { return Mapping != NULL; }
+    void wait();
+    bool discard(size_t blocknum, size_t count);
+
+    // Flush written blocks to stable storage (msync for MMAP_IO)
+    void sync();
 };
@@ -2,65 +2,417 @@
 
 #pragma once
 
+#include "sfs/bitmap.h"
+#include "sfs/cache.h"
 #include "sfs/disk.h"
+#include "sfs/journal.h"
+#include "sfs/rwlock.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <stdint.h>
+#include <unistd.h>
+
+// Number of bits to shift by to multiply or divide by a power of two @n
+constexpr uint32_t block_shift(size_t n) { return n > 1 ? 1 + block_shift(n >> 1) : 0; }
+
+// On-disk geometry derived from a block size: how many inodes, pointers and
+// extents fit a block, and the shifts and masks that turn byte offsets into
+// block numbers. Every structure that fills a block is sized from here, so the
+// constants cannot drift apart; the arithmetic is what a division by the
+// constant block size compiles to anyway.
+template <size_t Size>
+struct BlockGeometry {
+    static_assert(Size >= 1024 && (Size & (Size - 1)) == 0, "block size must be a power of two of at least 1 KB");
+
+    static constexpr size_t   SIZE  = Size;
+    static constexpr uint32_t SHIFT = block_shift(Size);
+    static constexpr size_t   MASK  = Size - 1;
 
+    static constexpr uint32_t INODES_PER_BLOCK	   = Size / 32;	       // 32-bit inodes per block
+    static constexpr uint32_t INODES_PER_BLOCK_64  = Size / 64;	       // 64-bit inodes per block
+    static constexpr uint32_t INODES_PER_BLOCK_INLINE = Size / 512;    // Inodes per block with inline data
+    static constexpr uint32_t POINTERS_PER_BLOCK   = Size / 4;	       // 32-bit block pointers per block
+    static constexpr uint32_t EXTENTS_PER_BLOCK	   = (Size - 8) / 8;   // 32-bit extents per extent block
+    static constexpr uint32_t EXTENTS_PER_BLOCK_64 = (Size - 16) / 16; // 64-bit extents per extent block
+
+    // Block holding byte @offset, and where in it the byte lies
+    static constexpr size_t block_of(size_t offset)  { return offset >> SHIFT; }
+    static constexpr size_t offset_in(size_t offset) { return offset & MASK; }
+
+    // Blocks needed to hold @bytes bytes, and bytes held by @blocks blocks
+    static constexpr size_t blocks_for(size_t bytes) { return (bytes + MASK) >> SHIFT; }
+    static constexpr size_t bytes_of(size_t blocks)  { return blocks << SHIFT; }
+};
+
+// Once mounted, file operations may be called from several threads: reads of
+// the same or different inodes run in parallel, writes exclude other users of
+// the same inode only. format, mount and destruction must run alone, and a
+// handle must not be closed while another thread is using it.
 class FileSystem {
 public:
+    // Geometry of Disk::BLOCK_SIZE blocks: the disk, cache and journal move
+    // blocks of that size only, so it is the one block size mount accepts
+    typedef BlockGeometry<Disk::BLOCK_SIZE> Geometry;
+
     const static uint32_t MAGIC_NUMBER	     = 0xf0f03410;
-    const static uint32_t INODES_PER_BLOCK   = 128;
+    const static uint32_t INODES_PER_BLOCK   = Geometry::INODES_PER_BLOCK;
+    const static uint32_t INODES_PER_BLOCK_64 = Geometry::INODES_PER_BLOCK_64;
+    const static uint32_t INODES_PER_BLOCK_INLINE = Geometry::INODES_PER_BLOCK_INLINE;
+    const static uint32_t INLINE_DATA	     = 448;  // Bytes of a small file kept in its inode
     const static uint32_t POINTERS_PER_INODE = 5;
-    const static uint32_t POINTERS_PER_BLOCK = 1024;
+    const static uint32_t POINTERS_PER_BLOCK = Geometry::POINTERS_PER_BLOCK;
+    const static uint32_t INLINE_EXTENTS     = 2;
+    const static uint32_t EXTENTS_PER_BLOCK  = Geometry::EXTENTS_PER_BLOCK;
+    const static uint32_t EXTENTS_PER_BLOCK_64 = Geometry::EXTENTS_PER_BLOCK_64;
+    const static uint32_t POINTER_VERSION    = 0;    // Inodes map blocks with direct and indirect pointers
+    const static uint32_t EXTENT_VERSION     = 1;    // Inodes map blocks with extents
+    const static uint32_t EXTENT64_VERSION   = 2;    // Extents, with 64-bit block numbers and sizes
+    const static uint32_t INLINE_VERSION     = 3;    // EXTENT64_VERSION inodes followed by the data of small files
+    const static uint32_t INODE_TABLE_CHUNK  = 256;  // Inode blocks per mount read
+    const static uint32_t MOUNT_SCAN_BLOCKS  = 64;   // Fewest inode blocks per mount worker
+    const static uint32_t INODE_INIT_CHUNK   = 64;   // Inode blocks zeroed per initializer step
+    const static uint32_t DEFAULT_READAHEAD  = 64;   // Largest read-ahead window in blocks
+    const static uint32_t DELAYED_BLOCKS     = 1024; // Buffered blocks at which a writer allocates its own
+    const static uint32_t JOURNAL_RATIO      = 64;   // Disk blocks per journal block reserved by format
+    const static uint32_t MAX_JOURNAL_BLOCKS = 8192; // Largest journal reserved by format
+    const static uint32_t COMMIT_INTERVAL    = 1000; // Milliseconds between group commits of the journal
+    const static uint32_t MIN_JOURNAL_CACHE  = 32;   // Fewest cache blocks of a mount with a journal
+    const static uint32_t ALLOC_GROUP_BLOCKS = 32768; // Data blocks per allocation group
+    const static uint32_t PREALLOC_BLOCKS    = 256;  // Free blocks kept for the next allocation of an open file
 
 private:
-    struct SuperBlock {		// Superblock structure
+    struct SuperBlock {		// In-core superblock, stored as is from EXTENT64_VERSION on
+    	uint32_t MagicNumber;	// File system magic number
+    	uint32_t Reserved[7];	// Zero where older versions keep their geometry
+    	uint32_t Version;	// Inode format (any of the *_VERSION constants)
+    	uint32_t Clean;		// Whether or not the allocation bitmaps are up to date
+    	uint64_t Blocks;	// Number of blocks in file system
+    	uint64_t InodeBlocks;	// Number of blocks reserved for inodes
+    	uint64_t Inodes;	// Number of inodes in file system
+    	uint64_t BitmapStart;	// First block of the allocation bitmaps (0 if none)
+    	uint64_t BitmapBlocks;	// Number of blocks holding the allocation bitmaps
+    	uint64_t InodeInitEnd;	// First inode block not zeroed yet (0 if all are)
+    	uint64_t JournalStart;	// First block of the metadata journal (0 if none)
+    	uint64_t JournalBlocks;	// Number of blocks of the metadata journal
+    	uint64_t BlockSize;	// Bytes per block (0 if formatted before it was recorded: 4096)
+    	uint64_t ReservedBlocks; // Free data blocks that allocation leaves alone
+    };
+
+    struct SuperBlock32 {	// Superblock of POINTER_VERSION and EXTENT_VERSION
     	uint32_t MagicNumber;	// File system magic number
     	uint32_t Blocks;	// Number of blocks in file system
     	uint32_t InodeBlocks;	// Number of blocks reserved for inodes
     	uint32_t Inodes;	// Number of inodes in file system
+    	uint32_t Clean;		// Whether or not the allocation bitmaps are up to date
+    	uint32_t BitmapStart;	// First block of the allocation bitmaps (0 if none)
+    	uint32_t BitmapBlocks;	// Number of blocks holding the allocation bitmaps
+    	uint32_t InodeInitEnd;	// First inode block not zeroed yet (0 if all are)
+    	uint32_t Version;	// Inode format (POINTER_VERSION or EXTENT_VERSION)
+    	uint32_t JournalStart;	// First block of the metadata journal (0 if none)
+    	uint32_t JournalBlocks;	// Number of blocks of the metadata journal
+    	uint32_t BlockSize;	// Bytes per block (0 if formatted before it was recorded: 4096)
+    	uint32_t ReservedBlocks; // Free data blocks that allocation leaves alone
     };
 
-    struct Inode {
+    struct Extent {		// Run of physically contiguous blocks
+    	uint64_t Start;		// First block (0 for a hole)
+    	uint64_t Length;	// Number of blocks
+    };
+
+    struct Extent32 {		// Extent of EXTENT_VERSION
+    	uint32_t Start;		// First block (0 for a hole)
+    	uint32_t Length;	// Number of blocks
+    };
+
+    struct Inode {		// In-core inode, stored as is from EXTENT64_VERSION on (INLINE_VERSION
+    				// follows it with INLINE_DATA bytes of data while the file fits)
+    	uint32_t Valid;		// Whether or not inode is valid
+    	uint32_t ExtentCount;	// Number of extents, holes included
+    	uint64_t Size;		// Size of file
+    	uint64_t Overflow;	// First extent block (0 if none)
+    	union {
+    	    struct {		// POINTER_VERSION
+    	    	uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
+    	    	uint32_t Indirect;	// Indirect pointer
+    	    };
+    	    Extent Extents[INLINE_EXTENTS]; // First extents of the file
+    	};
+    	uint64_t Reserved;	// Zero
+    };
+
+    struct Inode32 {		// Inode of POINTER_VERSION and EXTENT_VERSION
     	uint32_t Valid;		// Whether or not inode is valid
     	uint32_t Size;		// Size of file
-    	uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
-    	uint32_t Indirect;	// Indirect pointer
+    	union {
+    	    struct {		// POINTER_VERSION
+    	    	uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
+    	    	uint32_t Indirect;	// Indirect pointer
+    	    };
+    	    struct {		// EXTENT_VERSION
+    	    	Extent32 Extents[INLINE_EXTENTS]; // First extents of the file
+    	    	uint32_t ExtentCount;	// Number of extents, holes included
+    	    	uint32_t Overflow;	// First extent block (0 if none)
+    	    };
+    	};
+    };
+
+    struct ExtentBlock {	// Extents that do not fit in the inode (EXTENT64_VERSION)
+    	Extent	 Extents[EXTENTS_PER_BLOCK_64]; // Next extents of the file
+    	uint64_t Count;		// Number of extents used in this block
+    	uint64_t Next;		// Next extent block (0 if last)
+    };
+
+    struct ExtentBlock32 {	// Extents that do not fit in the inode (EXTENT_VERSION)
+    	Extent32 Extents[EXTENTS_PER_BLOCK]; // Next extents of the file
+    	uint32_t Count;		// Number of extents used in this block
+    	uint32_t Next;		// Next extent block (0 if last)
     };
 
     union Block {
-    	SuperBlock  Super;			    // Superblock
-    	Inode	    Inodes[INODES_PER_BLOCK];	    // Inode block
+    	SuperBlock  Super;			    // Superblock (EXTENT64_VERSION on)
+    	SuperBlock32 Super32;			    // Superblock (older versions)
+    	Inode	    Inodes[INODES_PER_BLOCK_64];    // Inode block (EXTENT64_VERSION)
+    	Inode32	    Inodes32[INODES_PER_BLOCK];	    // Inode block (older versions)
     	uint32_t    Pointers[POINTERS_PER_BLOCK];   // Pointer block
-    	char	    Data[Disk::BLOCK_SIZE];	    // Data block
+    	ExtentBlock Overflow;			    // Extent block (EXTENT64_VERSION on)
+    	ExtentBlock32 Overflow32;		    // Extent block (EXTENT_VERSION)
+    	char	    Data[Geometry::SIZE];	    // Data block
+    };
+
+    static_assert(sizeof(Inode) * INODES_PER_BLOCK_64 == Geometry::SIZE && sizeof(Inode32) * INODES_PER_BLOCK == Geometry::SIZE &&
+    		  sizeof(ExtentBlock) == Geometry::SIZE && sizeof(ExtentBlock32) == Geometry::SIZE && sizeof(Block) == Geometry::SIZE,
+    		  "on-disk structures must fill a block exactly");
+
+    struct FileExtent {		// Extent placed in a file
+    	uint64_t Logical;	// First logical block
+    	uint64_t Start;		// First physical block
+    	uint64_t Length;	// Number of blocks
+    };
+
+    struct OpenInode {		// In-core inode shared by all handles of a file
+    	size_t	 Inumber;	// Inode number
+    	size_t	 References;	// Number of users of this in-core inode
+    	bool	 Dirty;		// Whether or not the block map must be saved
+    	std::vector<FileExtent> Extents; // Allocated extents by logical block (holes left out)
+    	std::vector<uint64_t> MapBlocks; // Indirect block or chain of extent blocks
+    	std::map<uint64_t, char *> Delayed; // Written blocks not allocated yet, by logical block
+    	size_t	 Reserved;	// Free blocks held back for Delayed and the block map blocks it may need
+    	RWLock	 Lock;		// Shared for reads, exclusive for writes
+    	std::mutex ReadaheadLock; // Protects the read-ahead state below
+    	size_t	 NextOffset;	// Offset where a sequential read would continue
+    	size_t	 Window;	// Current read-ahead window in blocks (0 after a random read)
+    	size_t	 ReadaheadEnd;	// Logical block up to which data was read ahead
+    	size_t	 PreallocStart;	// Free blocks after the last allocation that other files
+    	size_t	 PreallocEnd;	// leave alone (both under alloc_lock, none if equal)
+    };
+
+public:
+    struct FormatOptions {	// Geometry chosen by format (zero fields take the defaults)
+    	uint64_t Inodes;	// Number of inodes, rounded up to whole inode blocks
+    	uint64_t BytesPerInode;	// Disk bytes per inode, if Inodes is 0 (default: a tenth of the blocks hold inodes)
+    	uint64_t ReservedBlocks; // Data blocks kept free, so allocation still finds long runs on a nearly full disk
+    };
+
+    struct AllocatorStats {	// Allocator activity since mount or the last reset_stats
+    	size_t	 Extents;	// Runs of blocks allocated
+    	size_t	 Blocks;	// Blocks allocated
+    	size_t	 Freed;		// Blocks returned to the free block map
+    	size_t	 Failures;	// Allocations that found no free block
+    };
+
+private:
+    struct FileHandle {		// Open file
+    	OpenInode *Node;	// In-core inode
+    	size_t	   Position;	// Current file offset
+    };
+
+    class MetadataUpdate {	// Operation pinning metadata blocks: holds room for them in the cache and
+    				// journal_lock shared from construction to destruction
+    private:
+    	FileSystem &FS;
+    	size_t	    Blocks;
+
+    public:
+    	MetadataUpdate(FileSystem *fs, size_t blocks) : FS(*fs), Blocks(blocks) {
+    	    FS.make_room(Blocks);
+    	    FS.journal_lock.lock_shared();
+    	}
+    	~MetadataUpdate() {
+    	    FS.free_room(Blocks);
+    	    FS.journal_lock.unlock_shared();
+    	}
     };
 
     // TODO: Internal helper functions
-    void set_free_block_map(uint32_t *pointer, uint32_t length, uint32_t value);
-    bool load_inode(size_t inumber, Inode *node);
+    static const Block *view_block(Disk *disk, size_t blocknum, Block *buffer);
+    static size_t debug_extents(Disk *disk, uint32_t version, const Inode &inode);
+    static void print_extent(const Extent &extent);
+    static uint64_t inode_blocks(uint64_t blocks, uint32_t version, const FormatOptions &options);
+    static size_t inode_size(uint32_t version);
+    static size_t extents_per_block(uint32_t version);
+    static void load_superblock(const Block &block, SuperBlock *super);
+    static void store_superblock(const SuperBlock &super, Block *block);
+    static void load_inode(const char *raw, uint32_t version, Inode *inode);
+    static void store_inode(const Inode &inode, uint32_t version, char *raw);
+    static void load_extent_block(const Block *block, uint32_t version, std::vector<Extent> &extents, uint64_t *next);
+    static void store_extent_block(const Extent *extents, size_t count, uint64_t next, uint32_t version, Block *block);
+    static uint64_t bitmap_blocks(uint64_t blocks, uint64_t inodes);
+    static uint64_t journal_blocks(uint64_t blocks);
+    static void pack_bitmaps(const Bitmap &blocks, const Bitmap &inodes, char *buffer, size_t size);
+    static void mark_used(Bitmap *used, const std::vector<FileExtent> &extents, const std::vector<uint64_t> &mapBlocks);
+    static size_t mark_free(Bitmap *used, const std::vector<FileExtent> &extents, const std::vector<uint64_t> &mapBlocks);
+    static void append_extent(std::vector<FileExtent> &extents, uint64_t logical, uint64_t start, uint64_t length);
+    void load_inode_table();
+    void save_superblock();
+    void initialize_inodes();
+    void init_inode_blocks(uint64_t end);
+    void scan_inodes();
+    void scan_inode_range(size_t from, size_t to, Bitmap *used);
+    void load_bitmaps();
+    void save_bitmaps();
+    void release_blocks(const std::vector<FileExtent> &extents, const std::vector<uint64_t> &mapBlocks);
     bool save_inode(size_t inumber, Inode *node);
+    void write_metadata(size_t blocknum, size_t offset, size_t length, const char *data);
+    void make_room(size_t blocks);
+    void free_room(size_t blocks);
+    void commit_journal();
+    void run_committer();
+    bool is_inline(OpenInode *node);
+    void inline_range(size_t inumber, size_t offset, size_t length, char *data, bool write);
     bool out_of_bound_inumber(size_t inumber);
     bool pre_requisite();
-    size_t inner_read(uint32_t *bnumPointer, uint32_t bnumNumber, size_t length, char *data, size_t offset);
-    size_t inner_write(uint32_t *bnumPointer, uint32_t bnumNumber, size_t length, char *data, size_t offset);
-    ssize_t allocate_free_block();//return value must be signed if it uses -1 as error value!!!!
+    size_t inner_read(OpenInode *node, char *data, size_t length, size_t offset);
+    size_t inner_write(OpenInode *node, char *data, size_t length, size_t offset);
+    bool inner_truncate(OpenInode *node, size_t size);
+    bool move_inline(OpenInode *node);
+    void readahead(OpenInode *node, size_t offset, size_t length);
+    bool delay_block(OpenInode *node, size_t b, size_t start, size_t length, const char *data);
+    void flush_delayed(OpenInode *node);
+    ssize_t find_data(OpenInode *node, size_t offset, bool hole);
+    uint64_t lookup(OpenInode *node, size_t b, size_t *run);
+    size_t max_file_blocks() const;
+    size_t disk_extents(OpenInode *node);
+    size_t extent_blocks(size_t extents) const;
+    ssize_t map_blocks(OpenInode *node, size_t b, size_t count, size_t *mapped, bool *fresh);
+    OpenInode *get_inode(size_t inumber);
+    void put_inode(OpenInode *node);
+    void load_block_map(const Inode *inode, std::vector<FileExtent> &extents, std::vector<uint64_t> &mapBlocks, bool scan);
+    void read_map_block(uint64_t bnum, Block *buffer, bool scan);
+    void save_block_map(OpenInode *node);
+    void save_extents(OpenInode *node);
+    FileHandle *get_handle(size_t handle);
+    void release_handles();
+    ssize_t allocate_free_block(size_t *reserve = NULL);//return value must be signed if it uses -1 as error value!!!!
+    ssize_t allocate_extent(size_t goal, size_t max, size_t *count, OpenInode *owner = NULL, size_t *reserve = NULL);
+    ssize_t find_free(size_t from, size_t to, const OpenInode *owner);
+    static bool owns_window(const OpenInode *owner, size_t start);
+    void release_prealloc(OpenInode *node);
+    size_t group_goal(size_t inumber) const;
 
     // TODO: Internal member variables
     Disk *currMountedDisk = NULL;
-    uint32_t *free_block_map = NULL;
-    Inode *inode_table = NULL;
+    BlockCache *cache = NULL;
+    size_t cacheBlocks;
+    size_t readaheadBlocks;	// Largest read-ahead window (0 disables read-ahead)
+    SuperBlock meta = SuperBlock(); // Superblock of the mounted disk
+    size_t inodeSize = 0;	// Bytes per inode on disk
+    size_t inodesPerBlock = 0;	// Inodes per inode block
+    uint64_t dataStart = 0;	// First data block
+    Bitmap free_block_map;	// Set bits are used or reserved blocks
+    size_t allocHint = 0;	// Block where the next allocation search starts
+    size_t reservedBlocks = 0;	// Free blocks held back for delayed writes and the reserve
+    AllocatorStats allocStats = AllocatorStats(); // Allocator activity
+    std::map<uint64_t, uint64_t> preallocWindows; // Preallocation windows of open inodes, first block to end
+    mutable std::mutex alloc_lock; // Protects free_block_map, allocHint, reservedBlocks, allocStats and preallocWindows
+    std::atomic<size_t> delayedBlocks{0}; // Blocks buffered by all open inodes
+    Bitmap free_inode_map;	// Set bits are valid inodes
+    size_t inodeHint = 0;	// Lowest inode that may be free
+    Inode *inode_table = NULL;	// Entries of open inodes belong to their OpenInode lock
+    std::unordered_map<size_t, OpenInode *> open_inodes;
+    std::vector<FileHandle *> open_handles;
+    std::mutex table_lock;	// Protects inode allocation, open inodes and handles
+    std::thread inode_initializer; // Zeroes inode blocks from meta.InodeInitEnd on
+    bool stopInitializer = false;  // Asks inode_initializer to stop (under table_lock)
+    Journal *journal = NULL;	// Metadata journal of the mounted disk (NULL if it has none)
+    RWLock journal_lock;	// Shared while an operation pins its metadata, exclusive to collect a transaction
+    std::mutex commit_lock;	// Serializes commits and checkpoints
+    size_t commitThreshold = 0;	// Pinned blocks at which the committer is woken early
+    std::mutex room_lock;	// Protects roomBlocks and metadataInPlace
+    size_t roomBlocks = 0;	// Cache blocks reserved by the updates in flight
+    bool metadataInPlace = false; // Whether the update in flight is too large to pin and runs alone
+    std::vector<FileExtent> freedExtents; // Blocks freed since the last commit, released by the next
+    std::vector<uint64_t> freedMapBlocks; // (both under alloc_lock)
+    std::thread journal_committer; // Commits the journal every COMMIT_INTERVAL
+    std::mutex committer_lock;	// Protects stopCommitter
+    std::condition_variable commit_wakeup; // Wakes journal_committer early or to stop
+    bool stopCommitter = false;	// Asks journal_committer to stop
 
 public:
+    // @param	cacheBlocks Number of blocks kept in the block cache once mounted
+    // @param	readaheadBlocks Largest window read ahead of sequential reads (0 disables it)
+    FileSystem(size_t cacheBlocks = BlockCache::DEFAULT_CAPACITY, size_t readaheadBlocks = DEFAULT_READAHEAD)
+    	: cacheBlocks(cacheBlocks), readaheadBlocks(readaheadBlocks) {}
+
     static void debug(Disk *disk);
-    static bool format(Disk *disk);
+    // @param	lazyInodes  Leave the inode blocks to be zeroed in the background once mounted
+    // @param	version	    Inode format (EXTENT_VERSION switches to EXTENT64_VERSION if the
+    //			    disk is too large for 32-bit block numbers)
+    // @param	options	    Inode density and reserved blocks (fails if they leave no data block)
+    // Disks of JOURNAL_RATIO * Journal::MIN_BLOCKS blocks or more get a metadata journal
+    // of one block per JOURNAL_RATIO (up to MAX_JOURNAL_BLOCKS) before the allocation bitmaps
+    static bool format(Disk *disk, bool lazyInodes = false, uint32_t version = EXTENT_VERSION, const FormatOptions &options = FormatOptions());
 
     bool mount(Disk *disk);
 
+    // Save everything, mark the allocation bitmaps clean and release the disk
+    bool unmount();
+
     ssize_t create();
     bool    remove(size_t inumber);
     ssize_t stat(size_t inumber);
 
+    // Number of free data blocks not held back for delayed writes or the reserve (0 if not mounted)
+    size_t free_blocks() const {
+    	std::lock_guard<std::mutex> lock(alloc_lock);
+    	return free_block_map.size() - free_block_map.count() - reservedBlocks;
+    }
+
     ssize_t read(size_t inumber, char *data, size_t length, size_t offset);
     ssize_t write(size_t inumber, char *data, size_t length, size_t offset);
+
+    // Set the size of a file: the blocks past a smaller size are freed, a larger one leaves a hole
+    bool    truncate(size_t inumber, size_t size);
+
+    // Open inode and return a handle that keeps its block map in memory
+    ssize_t open(size_t inumber);
+    bool    close(size_t handle);
+
+    // Sequential I/O at the handle's position (returns 0 at end of file)
+    ssize_t read(size_t handle, char *data, size_t length);
+    ssize_t write(size_t handle, char *data, size_t length);
+    // @param	whence	    SEEK_SET moves to offset (which may lie past the end of the file),
+    //			    SEEK_DATA and SEEK_HOLE to the first data or hole from offset on
+    //			    (the end of the file counts as a hole; -1 if there is none)
+    ssize_t seek(size_t handle, size_t offset, int whence = SEEK_SET);
+
+    // Commit the journal, write dirty cached blocks and the allocation bitmaps back to disk
+    // and flush the disk
+    void sync();
+
+    // Block cache of the mounted disk (NULL if not mounted)
+    const BlockCache *block_cache() const { return cache; }
+
+    // Allocator activity of the mounted disk
+    AllocatorStats allocator_stats() const;
+
+    // Restart the operation counters (see Stats), the cache and the allocator statistics from zero
+    void reset_stats();
     ~FileSystem();
 };
@@ -0,0 +1,127 @@
+// journal.h: Write-ahead metadata journal
+
+#pragma once
+
+#include "sfs/cache.h"
+#include "sfs/disk.h"
+
+#include <vector>
+
+#include <stdint.h>
+
+// The journal is a circular log of whole-block metadata updates. Changed
+// metadata blocks are pinned in the cache (see BlockCache::write_pinned) and
+// committed together as one transaction: descriptor blocks listing their
+// numbers, their images and a commit block, each half made durable with a
+// disk sync. Committed blocks go back in place like any other dirty block,
+// and a checkpoint reclaims the log once every block it covers is in place.
+// Mounting replays every whole transaction logged since the last checkpoint.
+//
+// Commits and checkpoints must not run concurrently with each other; the
+// caller serializes them.
+class Journal {
+public:
+    const static uint32_t MAGIC_NUMBER	    = 0x4a524e4c;
+    const static size_t   MIN_BLOCKS	    = 16;   // Smallest useful journal (header included)
+    const static size_t   DESCRIPTOR_BLOCKS = 509;  // Block numbers per descriptor block
+
+private:
+    enum Type {
+    	HEADER	   = 1,		    // First block of the journal
+    	DESCRIPTOR = 2,		    // Numbers of the blocks logged after it
+    	COMMIT	   = 3,		    // End of a whole transaction
+    };
+
+    struct Header {		    // Where replay starts
+    	uint32_t MagicNumber;	    // Journal magic number
+    	uint32_t Type;		    // HEADER
+    	uint64_t Sequence;	    // Sequence number of the transaction at Tail
+    	uint64_t Tail;		    // Log block of the oldest transaction not checkpointed
+    };
+
+    struct Descriptor {		    // Starts a transaction and each further run of images
+    	uint32_t MagicNumber;	    // Journal magic number
+    	uint32_t Type;		    // DESCRIPTOR
+    	uint64_t Sequence;	    // Sequence number of the transaction
+    	uint64_t Count;		    // Number of images following this descriptor
+    	uint64_t Blocks[DESCRIPTOR_BLOCKS]; // Home location of each image
+    };
+
+    struct Commit {		    // Written once everything before it is durable
+    	uint32_t MagicNumber;	    // Journal magic number
+    	uint32_t Type;		    // COMMIT
+    	uint64_t Sequence;	    // Sequence number of the transaction
+    	uint64_t Count;		    // Number of images in the transaction
+    	uint64_t Checksum;	    // FNV-1a hash of the descriptors and images
+    };
+
+    Disk       *disk;		    // Disk holding the journal
+    BlockCache *cache;		    // Cache holding the blocks being logged
+    uint64_t	Start;		    // Header block
+    uint64_t	Area;		    // Number of log blocks after the header
+    uint64_t	Head;		    // Log position of the next transaction (never wraps)
+    uint64_t	Tail;		    // Log position of the oldest live transaction
+    uint64_t	Sequence;	    // Sequence number of the next transaction
+    uint64_t	TailSequence;	    // Sequence number of the transaction at Tail
+
+    size_t  Commits;		    // Number of transactions logged
+    size_t  Logged;		    // Number of block images logged
+    size_t  Checkpoints;	    // Number of times the log was reclaimed
+    size_t  Overflows;		    // Number of transactions too large for the log
+
+    // Transfer count blocks at log position (wrapping around the end of the log)
+    // @param	position    Log position of the first block
+    // @param	count	    Number of blocks
+    // @param	data	    Buffer of count blocks
+    // @param	write	    Whether to write (true) or read (false)
+    void transfer_log(uint64_t position, size_t count, char *data, bool write);
+
+    // Write the header with the current tail and sequence number
+    void write_header();
+
+    // Check the transaction logged at position
+    // @param	position    Log position of its first descriptor
+    // @param	sequence    Sequence number it must carry
+    // @param	blocks	    Home locations of its images
+    // @param	positions   Log positions of its images
+    // Returns the number of log blocks it takes, or 0 if it is not whole.
+    size_t read_transaction(uint64_t position, uint64_t sequence, std::vector<uint64_t> &blocks, std::vector<uint64_t> &positions);
+
+public:
+    // Constructor
+    // @param	disk	    Disk holding the journal
+    // @param	cache	    Cache of the disk
+    // @param	start	    First block of the journal (its header)
+    // @param	blocks	    Number of blocks of the journal, header included
+    Journal(Disk *disk, BlockCache *cache, uint64_t start, uint64_t blocks);
+
+    // Write an empty journal
+    // @param	disk	    Disk to hold the journal
+    // @param	start	    First block of the journal
+    // @param	blocks	    Number of blocks of the journal, header included
+    static void format(Disk *disk, uint64_t start, uint64_t blocks);
+
+    // Write every whole transaction since the last checkpoint in place and
+    // reset the log (the cache must not hold any block yet)
+    // Returns the number of transactions replayed, or -1 if the header is invalid.
+    ssize_t replay();
+
+    // Log blocks collected from the cache as one transaction, then release
+    // them; blocks that are dirty and not held are written in place first,
+    // so the data the new metadata points to is on disk before it is
+    // @param	blocks	    Home locations of the blocks
+    // @param	images	    Contents of the blocks, one after another
+    void commit(const std::vector<size_t> &blocks, const std::vector<char> &images);
+
+    // Put every logged block in place and empty the log
+    void checkpoint();
+
+    // Most blocks that fit a single transaction
+    size_t capacity() const { return Area - 1 - (Area - 1 + DESCRIPTOR_BLOCKS) / (DESCRIPTOR_BLOCKS + 1); }
+
+    // Return statistics
+    size_t commits()	 const { return Commits; }
+    size_t logged()	 const { return Logged; }
+    size_t checkpoints() const { return Checkpoints; }
+    size_t overflows()	 const { return Overflows; }
+};
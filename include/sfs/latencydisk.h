@@ -0,0 +1,58 @@
+// latencydisk.h: Disk with the service times of a real device
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <chrono>
+#include <mutex>
+
+#include <stdint.h>
+
+// Forwards every request to another disk and holds it for the time the
+// modelled device would take to serve it. The device serves one request at
+// a time: a request issued while it is busy waits for the ones before it.
+class LatencyDisk : public Disk {
+public:
+    // Service time model
+    struct Latency {
+    	const char *Name;	    // Name of the device
+    	uint64_t RequestNs;	    // Cost of every request
+    	uint64_t SeekNs;	    // Extra cost of a request not starting where the previous one ended
+    	uint64_t BlockNs;	    // Transfer time of one block
+    	uint64_t SyncNs;	    // Cost of flushing the device write cache
+    };
+
+    const static Latency SSD;	    // NVMe flash drive
+    const static Latency HDD;	    // 7200 rpm hard drive
+
+private:
+    Disk   *Inner;		    // Disk holding the data (owned)
+    Latency Model;		    // Service times
+    std::mutex Lock;		    // Protects BusyUntil and Position
+    std::chrono::steady_clock::time_point BusyUntil; // When the device serves its last queued request
+    size_t  Position;		    // Block after the end of the previous request
+
+    // Wait for the device to serve a request
+    // @param	blocknum    First block of the request
+    // @param	count	    Number of blocks (0 for a cache flush)
+    void serve(size_t blocknum, size_t count);
+
+protected:
+    void transfer_blocks(size_t blocknum, size_t count, char *data, bool write);
+    void transfer_vector(size_t blocknum, size_t count, char **buffers, bool write);
+
+public:
+    // Constructor
+    // @param	inner	    Opened disk to forward requests to (deleted with this disk)
+    // @param	latency	    Service times to impose
+    LatencyDisk(Disk *inner, const Latency &latency);
+
+    // Destructor
+    ~LatencyDisk();
+
+    const char *name() const { return Model.Name; }
+    void wait() { Inner->wait(); }
+    bool discard(size_t blocknum, size_t count);
+    void sync();
+};
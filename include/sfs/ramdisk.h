@@ -0,0 +1,47 @@
+// ramdisk.h: Disk kept in memory
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// The whole disk lives in memory, so block I/O costs a memcpy and nothing
+// reaches the host page cache. An image file, if given, is loaded when the
+// disk is opened and the blocks written since are stored back into it when
+// the disk is destroyed; sync does not touch it, so the contents do not
+// survive a crash.
+class RamDisk : public Disk {
+private:
+    char   *Memory;	    // Contents of the disk
+    std::vector<std::atomic<bool>> Dirty; // Whether or not each block was written since it was loaded
+    std::string Path;	    // Image to store the disk back into (empty if none)
+
+    // Store the blocks written since the image was loaded back into it
+    // Returns false (and sets errno) on error.
+    bool store();
+
+protected:
+    void transfer_blocks(size_t blocknum, size_t count, char *data, bool write);
+    const char *map_block(size_t blocknum);
+
+public:
+    // Default constructor
+    RamDisk() : Memory(NULL) {}
+
+    // Destructor (stores the disk back into its image)
+    ~RamDisk();
+
+    // Open disk
+    // @param	path	    Path to disk image (NULL for a disk that is never stored)
+    // @param	nblocks	    Number of blocks in disk
+    // Throws runtime_error exception on error.
+    void open(const char *path, size_t nblocks);
+
+    const char *name() const { return "ram"; }
+    bool mapped() const { return true; }
+    bool discard(size_t blocknum, size_t count);
+    void sync() {}
+};
@@ -0,0 +1,46 @@
+// rwlock.h: Reader/writer lock
+
+#pragma once
+
+#include <pthread.h>
+
+class RWLock {
+private:
+    pthread_rwlock_t Lock;
+
+public:
+    RWLock()  { pthread_rwlock_init(&Lock, NULL); }
+    ~RWLock() { pthread_rwlock_destroy(&Lock); }
+
+    // Acquire or release the lock shared with other readers
+    void lock_shared()	 { pthread_rwlock_rdlock(&Lock); }
+    void unlock_shared() { pthread_rwlock_unlock(&Lock); }
+
+    // Acquire or release the lock exclusively
+    void lock()		 { pthread_rwlock_wrlock(&Lock); }
+    void unlock()	 { pthread_rwlock_unlock(&Lock); }
+
+private:
+    RWLock(const RWLock &);
+    RWLock &operator=(const RWLock &);
+};
+
+// Hold a lock shared for the lifetime of the guard
+class ReadGuard {
+private:
+    RWLock &Lock;
+
+public:
+    ReadGuard(RWLock &lock) : Lock(lock) { Lock.lock_shared(); }
+    ~ReadGuard() { Lock.unlock_shared(); }
+};
+
+// Hold a lock exclusively for the lifetime of the guard
+class WriteGuard {
+private:
+    RWLock &Lock;
+
+public:
+    WriteGuard(RWLock &lock) : Lock(lock) { Lock.lock(); }
+    ~WriteGuard() { Lock.unlock(); }
+};
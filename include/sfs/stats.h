@@ -0,0 +1,82 @@
+// stats.h: Operation counters and latency histograms
+
+#pragma once
+
+#include <chrono>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Counters are process-wide. Each thread records into its own slot with
+// plain (uncontended) stores, and readers merge every slot under a lock, so
+// recording never waits on a reader or on another thread. Slots of exited
+// threads are folded into a running total; reset only moves the baseline
+// that snapshots are taken against.
+class Stats {
+public:
+    // Instrumented operations
+    enum Op {
+    	CREATE,			    // FileSystem::create
+    	REMOVE,			    // FileSystem::remove
+    	STAT,			    // FileSystem::stat
+    	READ,			    // FileSystem::read (by inode or handle)
+    	WRITE,			    // FileSystem::write (by inode or handle)
+    	MOUNT,			    // FileSystem::mount
+    	DISK_READ,		    // Read request issued to the disk image
+    	DISK_WRITE,		    // Write request issued to the disk image
+    	OPS,			    // Number of instrumented operations
+    };
+
+    // Latency bucket i counts operations that took less than 2^i ns (and at least 2^(i-1) ns)
+    const static size_t BUCKETS = 40;
+
+    struct Counter {
+    	uint64_t Count;		    // Number of operations
+    	uint64_t Nanoseconds;	    // Total time spent in them
+    	uint64_t Bytes;		    // Bytes they transferred
+    	uint64_t Buckets[BUCKETS];  // Log2 latency histogram
+    };
+
+    struct Snapshot {
+    	Counter Ops[OPS];	    // Counters since the last reset, by operation
+    };
+
+    // Count one operation
+    // @param	op	    Operation performed
+    // @param	nanoseconds Time it took
+    static void record(Op op, uint64_t nanoseconds);
+
+    // Count bytes transferred by an operation
+    // @param	op	    Operation that transferred them
+    // @param	bytes	    Number of bytes
+    static void transferred(Op op, uint64_t bytes);
+
+    // Merge the counters of every thread since the last reset
+    // @param	snapshot    Snapshot to fill
+    static void snapshot(Snapshot *snapshot);
+
+    // Start counting from zero again
+    static void reset();
+
+    // Return the lowercase name of an operation
+    static const char *name(Op op);
+
+    // Return an upper bound in nanoseconds of the given percentile of a histogram
+    // @param	counter	    Counter to look at
+    // @param	percentile  Percentile between 0 and 100
+    static uint64_t percentile(const Counter &counter, double percentile);
+};
+
+// Record the time from construction to destruction as one operation
+class StatsTimer {
+private:
+    Stats::Op Op;
+    std::chrono::steady_clock::time_point Start;
+
+public:
+    StatsTimer(Stats::Op op) : Op(op), Start(std::chrono::steady_clock::now()) {}
+    ~StatsTimer() {
+    	std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - Start;
+    	Stats::record(Op, elapsed.count());
+    }
+};
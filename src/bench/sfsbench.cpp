@@ -0,0 +1,300 @@
+// sfsbench.cpp: File system benchmark
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Macros
+
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+// Constants
+
+const size_t MAX_FILE_SIZE  = 16 << 20;	// Largest file read and written
+const size_t RANDOM_OPS	    = 1024;	// Operations per random read or write workload
+const size_t CHURN_OPS	    = 1000;	// Create/write/remove cycles
+const size_t CHURN_SIZE	    = 4096;	// Bytes written per churned file
+const size_t MOUNT_FILES    = 1000;	// Files on the image mounted by the mount workload
+const size_t REPEATS	    = 5;	// Runs of the format and mount workloads
+const size_t IO_SIZES[]	    = {4096, 65536, 1 << 20}; // Bytes per read or write
+
+// Result of one workload
+
+struct Result {
+    const char *Workload;	// Name of the workload
+    size_t	Size;		// Bytes per operation (0 if not an I/O)
+    size_t	Ops;		// Number of operations
+    double	Seconds;	// Elapsed time, including the final sync of writes
+    double	P50;		// Median latency of one operation in microseconds
+    double	P99;		// 99th percentile latency in microseconds
+    size_t	Reads;		// Disk block reads during the workload
+    size_t	Writes;		// Disk block writes during the workload
+};
+
+// Times one workload: each operation runs between begin() and end(), then finish() sums it up
+class Timer {
+private:
+    Disk   *disk;
+    size_t  Reads;
+    size_t  Writes;
+    std::vector<double> Latencies;
+    std::chrono::steady_clock::time_point Start;
+    std::chrono::steady_clock::time_point OpStart;
+
+public:
+    Timer(Disk *disk) : disk(disk), Reads(disk->reads()), Writes(disk->writes()), Start(std::chrono::steady_clock::now()) {}
+
+    void begin() { OpStart = std::chrono::steady_clock::now(); }
+
+    void end() {
+    	std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - OpStart;
+    	Latencies.push_back(elapsed.count());
+    }
+
+    Result finish(const char *workload, size_t size) {
+    	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - Start;
+    	std::sort(Latencies.begin(), Latencies.end());
+
+    	Result result;
+    	result.Workload = workload;
+    	result.Size	= size;
+    	result.Ops	= Latencies.size();
+    	result.Seconds	= elapsed.count();
+    	result.P50	= Latencies.empty() ? 0 : Latencies[(Latencies.size() - 1) / 2];
+    	result.P99	= Latencies.empty() ? 0 : Latencies[(Latencies.size() - 1) * 99 / 100];
+    	result.Reads	= disk->reads() - Reads;
+    	result.Writes	= disk->writes() - Writes;
+    	return result;
+    }
+};
+
+// Deterministic pseudo-random numbers, so runs can be compared
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Drop everything cached by remounting
+static bool remount(FileSystem *fs, Disk *disk) {
+    return fs->unmount() && fs->mount(disk);
+}
+
+// Write or read a whole file through a handle, size bytes per operation
+static bool sequential(FileSystem *fs, Disk *disk, size_t inumber, size_t fileSize, size_t size, bool write, std::vector<Result> &results) {
+    std::vector<char> buffer(size, 'x');
+    ssize_t handle = fs->open(inumber);
+    if (handle < 0) {
+    	return false;
+    }
+
+    Timer timer(disk);
+    for (size_t offset = 0; offset < fileSize; offset += size) {
+    	timer.begin();
+    	ssize_t result = write ? fs->write(handle, &buffer[0], size) : fs->read(handle, &buffer[0], size);
+    	timer.end();
+    	if (result != (ssize_t)size) {
+    	    fs->close(handle);
+    	    return false;
+	}
+    }
+    fs->close(handle);
+    if (write) {
+    	fs->sync();
+    }
+    results.push_back(timer.finish(write ? "seqwrite" : "seqread", size));
+    return true;
+}
+
+// Read or overwrite size bytes at RANDOM_OPS random aligned offsets of a file
+static bool random_io(FileSystem *fs, Disk *disk, size_t inumber, size_t fileSize, size_t size, bool write, std::vector<Result> &results) {
+    std::vector<char> buffer(size, 'y');
+    uint64_t state = 0x9e3779b97f4a7c15ULL + size;
+    size_t slots = fileSize / size;
+
+    Timer timer(disk);
+    for (size_t i = 0; i < RANDOM_OPS; i++) {
+    	size_t offset = next_random(&state) % slots * size;
+    	timer.begin();
+    	ssize_t result = write ? fs->write(inumber, &buffer[0], size, offset) : fs->read(inumber, &buffer[0], size, offset);
+    	timer.end();
+    	if (result != (ssize_t)size) {
+    	    return false;
+	}
+    }
+    if (write) {
+    	fs->sync();
+    }
+    results.push_back(timer.finish(write ? "randwrite" : "randread", size));
+    return true;
+}
+
+// Create a file, write CHURN_SIZE bytes to it and remove it, CHURN_OPS times
+static bool churn(FileSystem *fs, Disk *disk, std::vector<Result> &results) {
+    std::vector<char> buffer(CHURN_SIZE, 'z');
+
+    Timer timer(disk);
+    for (size_t i = 0; i < CHURN_OPS; i++) {
+    	timer.begin();
+    	ssize_t inumber = fs->create();
+    	bool ok = inumber >= 0 && fs->write(inumber, &buffer[0], CHURN_SIZE, 0) == (ssize_t)CHURN_SIZE && fs->remove(inumber);
+    	timer.end();
+    	if (!ok) {
+    	    return false;
+	}
+    }
+    fs->sync();
+    results.push_back(timer.finish("churn", CHURN_SIZE));
+    return true;
+}
+
+// Fill the image with MOUNT_FILES small files and time mounting it
+static bool mount_time(FileSystem *fs, Disk *disk, std::vector<Result> &results) {
+    std::vector<char> buffer(CHURN_SIZE, 'm');
+    for (size_t i = 0; i < MOUNT_FILES; i++) {
+    	ssize_t inumber = fs->create();
+    	if (inumber < 0 || fs->write(inumber, &buffer[0], CHURN_SIZE, 0) != (ssize_t)CHURN_SIZE) {
+    	    return false;
+	}
+    }
+    if (!fs->unmount()) {
+    	return false;
+    }
+
+    Timer timer(disk);
+    for (size_t i = 0; i < REPEATS; i++) {
+    	timer.begin();
+    	bool ok = fs->mount(disk);
+    	timer.end();
+    	if (!ok || !fs->unmount()) {
+    	    return false;
+	}
+    }
+    results.push_back(timer.finish("mount", 0));
+    return fs->mount(disk);
+}
+
+// Report
+
+static void report(FILE *stream, const std::vector<Result> &results, bool json) {
+    if (json) {
+    	fprintf(stream, "[\n");
+    } else {
+    	fprintf(stream, "workload,size,ops,seconds,mb_per_s,ops_per_s,p50_us,p99_us,reads_per_op,writes_per_op\n");
+    }
+    for (size_t i = 0; i < results.size(); i++) {
+    	const Result &r = results[i];
+    	double mbps = r.Seconds > 0 ? (double)r.Size * r.Ops / r.Seconds / (1 << 20) : 0;
+    	double opss = r.Seconds > 0 ? r.Ops / r.Seconds : 0;
+    	double rpo  = r.Ops ? (double)r.Reads / r.Ops : 0;
+    	double wpo  = r.Ops ? (double)r.Writes / r.Ops : 0;
+    	if (json) {
+    	    fprintf(stream, "  {\"workload\": \"%s\", \"size\": %lu, \"ops\": %lu, \"seconds\": %.6f, \"mb_per_s\": %.2f, "
+    	    	    "\"ops_per_s\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"reads_per_op\": %.3f, \"writes_per_op\": %.3f}%s\n",
+    	    	    r.Workload, r.Size, r.Ops, r.Seconds, mbps, opss, r.P50, r.P99, rpo, wpo, i + 1 < results.size() ? "," : "");
+	} else {
+    	    fprintf(stream, "%s,%lu,%lu,%.6f,%.2f,%.1f,%.2f,%.2f,%.3f,%.3f\n",
+    	    	    r.Workload, r.Size, r.Ops, r.Seconds, mbps, opss, r.P50, r.P99, rpo, wpo);
+	}
+    }
+    if (json) {
+    	fprintf(stream, "]\n");
+    }
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 5) {
+    	fprintf(stderr, "Usage: %s <diskfile> <nblocks> [csv|json] [file|mmap|async|ram|ssd|hdd]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    bool json = false;
+    if (argc >= 4) {
+    	if (streq(argv[3], "json")) {
+    	    json = true;
+	} else if (!streq(argv[3], "csv")) {
+    	    fprintf(stderr, "Unknown report format: %s\n", argv[3]);
+    	    return EXIT_FAILURE;
+	}
+    }
+
+    // The library prints its counters and warnings on stdout: keep the report alone there
+    FILE *stream = fdopen(dup(STDOUT_FILENO), "w");
+    if (stream == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+    	perror("Unable to set up report stream");
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    bool ok = true;
+    {
+    	std::unique_ptr<Disk> disk;
+    	FileSystem fs;
+
+    	try {
+    	    disk.reset(Disk::create(argc == 5 ? argv[4] : "file", argv[1], strtoull(argv[2], NULL, 10)));
+	} catch (std::runtime_error &e) {
+    	    fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+    	    return EXIT_FAILURE;
+	}
+    	if (!disk) {
+    	    fprintf(stderr, "Unknown disk backend: %s\n", argv[4]);
+    	    return EXIT_FAILURE;
+	}
+
+    	Timer timer(disk.get());
+    	for (size_t i = 0; i < REPEATS && ok; i++) {
+    	    timer.begin();
+    	    ok = FileSystem::format(disk.get());
+    	    timer.end();
+	}
+    	results.push_back(timer.finish("format", 0));
+    	if (!ok || !fs.mount(disk.get())) {
+    	    fprintf(stderr, "Unable to format and mount %s\n", argv[1]);
+    	    return EXIT_FAILURE;
+	}
+
+    	size_t fileSize = fs.free_blocks() / 2 * Disk::BLOCK_SIZE;
+    	if (fileSize > MAX_FILE_SIZE) {
+    	    fileSize = MAX_FILE_SIZE;
+	}
+    	fileSize -= fileSize % IO_SIZES[sizeof(IO_SIZES) / sizeof(IO_SIZES[0]) - 1];
+    	if (fileSize == 0) {
+    	    fprintf(stderr, "Disk is too small to benchmark\n");
+    	    return EXIT_FAILURE;
+	}
+
+    	// Each read workload starts with a cold cache
+    	for (size_t i = 0; i < sizeof(IO_SIZES) / sizeof(IO_SIZES[0]) && ok; i++) {
+    	    size_t size = IO_SIZES[i];
+    	    ssize_t inumber = fs.create();
+    	    ok = inumber >= 0 &&
+    	    	 sequential(&fs, disk.get(), inumber, fileSize, size, true, results) && remount(&fs, disk.get()) &&
+    	    	 sequential(&fs, disk.get(), inumber, fileSize, size, false, results) &&
+    	    	 random_io(&fs, disk.get(), inumber, fileSize, size, true, results) && remount(&fs, disk.get()) &&
+    	    	 random_io(&fs, disk.get(), inumber, fileSize, size, false, results) &&
+    	    	 fs.remove(inumber);
+	}
+    	ok = ok && churn(&fs, disk.get(), results) && mount_time(&fs, disk.get(), results);
+    	if (!ok) {
+    	    fprintf(stderr, "Benchmark failed after %lu workloads\n", results.size());
+	}
+    }
+
+    report(stream, results, json);
+    fclose(stream);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
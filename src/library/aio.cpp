@@ -0,0 +1,378 @@
+// aio.cpp: asynchronous block I/O queue
+
+#include "sfs/aio.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Finish a transfer synchronously, resuming after partial transfers
+static bool transfer(int fd, bool write, char *data, size_t length, off_t offset) {
+    while (length > 0) {
+    	ssize_t n = write ? pwrite(fd, data, length, offset) : pread(fd, data, length, offset);
+    	if (n < 0 && errno == EINTR) {
+    	    continue;
+	}
+    	if (n <= 0) {
+    	    if (n == 0) {
+    	    	errno = EIO;
+	    }
+    	    return false;
+	}
+    	data   += n;
+    	length -= n;
+    	offset += n;
+    }
+    return true;
+}
+
+// io_uring queue ---------------------------------------------------------------
+
+class UringQueue : public IOQueue {
+private:
+    struct Request {
+    	int	     FD;
+    	bool	     Write;
+    	struct iovec IOV;
+    	off_t	     Offset;
+    };
+
+    int		    RingFD;	    // io_uring file descriptor
+    unsigned	    Depth;	    // Maximum number of requests in flight
+    void	   *SQRing;	    // Submission ring mapping
+    size_t	    SQRingSize;
+    void	   *CQRing;	    // Completion ring mapping (may alias SQRing)
+    size_t	    CQRingSize;
+    struct io_uring_sqe *SQEs;	    // Submission queue entries
+    size_t	    SQEsSize;
+    unsigned	   *SQTail;
+    unsigned	   *SQMask;
+    unsigned	   *SQArray;
+    unsigned	   *CQHead;
+    unsigned	   *CQTail;
+    unsigned	   *CQMask;
+    struct io_uring_cqe *CQEs;
+
+    std::vector<Request>  Requests;  // Request slots, indexed by user_data
+    std::vector<unsigned> FreeSlots; // Unused request slots
+    unsigned	    Pending;	    // Requests queued but not yet entered
+    unsigned	    InFlight;	    // Requests entered but not yet reaped
+    bool	    Broken;	    // Whether io_uring_enter failed for good (requests then run synchronously)
+    int		    Error;	    // First error seen since last wait
+
+    UringQueue() : RingFD(-1), SQRing(MAP_FAILED), CQRing(MAP_FAILED), SQEs((struct io_uring_sqe *)MAP_FAILED),
+    	Pending(0), InFlight(0), Broken(false), Error(0) {}
+
+    // Submit pending requests and wait for at least min_complete completions
+    void enter(unsigned min_complete) {
+    	while (!Broken) {
+    	    int n = syscall(__NR_io_uring_enter, RingFD, Pending, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    	    if (n >= 0) {
+    	    	Pending  -= n;
+    	    	InFlight += n;
+    	    	return;
+	    }
+    	    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    	    	// Ring is unusable; complete the queued requests synchronously
+    	    	Broken = true;
+    	    	run_pending();
+    	    	return;
+	    }
+	}
+    }
+
+    // Take back the requests queued since the last successful enter (the
+    // kernel never saw them) and transfer them synchronously in order
+    void run_pending() {
+    	unsigned tail  = *SQTail;
+    	unsigned first = tail - Pending;
+    	for (unsigned i = first; i != tail; i++) {
+    	    unsigned slot = SQEs[SQArray[i & *SQMask]].user_data;
+    	    Request &request = Requests[slot];
+    	    if (!transfer(request.FD, request.Write, (char *)request.IOV.iov_base, request.IOV.iov_len, request.Offset) && !Error) {
+    	    	Error = errno;
+	    }
+    	    FreeSlots.push_back(slot);
+	}
+    	__atomic_store_n(SQTail, first, __ATOMIC_RELEASE);
+    	Pending = 0;
+    }
+
+    // Wait for the requests the ring took before it broke: they still
+    // complete, so poll for their completions
+    void drain() {
+    	while (InFlight > 0) {
+    	    reap();
+    	    if (InFlight > 0) {
+    	    	sched_yield();
+	    }
+	}
+    }
+
+    // Reap every available completion
+    void reap() {
+    	unsigned head = *CQHead;
+    	unsigned tail = __atomic_load_n(CQTail, __ATOMIC_ACQUIRE);
+    	for (; head != tail; head++) {
+    	    struct io_uring_cqe *cqe = &CQEs[head & *CQMask];
+    	    Request &request = Requests[cqe->user_data];
+    	    if (cqe->res < 0) {
+    	    	Error = -cqe->res;
+	    } else if ((size_t)cqe->res < request.IOV.iov_len) {
+    	    	// Short transfer: finish the rest synchronously
+    	    	if (!transfer(request.FD, request.Write, (char *)request.IOV.iov_base + cqe->res,
+    	    	    	      request.IOV.iov_len - cqe->res, request.Offset + cqe->res)) {
+    	    	    Error = errno;
+		}
+	    }
+    	    FreeSlots.push_back(cqe->user_data);
+    	    InFlight--;
+	}
+    	__atomic_store_n(CQHead, head, __ATOMIC_RELEASE);
+    }
+
+public:
+    static UringQueue *create(size_t depth) {
+    	struct io_uring_params params;
+    	memset(&params, 0, sizeof(params));
+
+    	UringQueue *queue = new UringQueue();
+    	queue->RingFD = syscall(__NR_io_uring_setup, depth, &params);
+    	if (queue->RingFD < 0) {
+    	    delete queue;
+    	    return NULL;
+	}
+
+    	queue->SQRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    	queue->CQRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    	    if (queue->CQRingSize > queue->SQRingSize) {
+    	    	queue->SQRingSize = queue->CQRingSize;
+	    }
+    	    queue->CQRingSize = queue->SQRingSize;
+	}
+    	queue->SQRing = mmap(NULL, queue->SQRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, queue->RingFD, IORING_OFF_SQ_RING);
+    	if (queue->SQRing == MAP_FAILED) {
+    	    delete queue;
+    	    return NULL;
+	}
+    	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    	    queue->CQRing = queue->SQRing;
+	} else {
+    	    queue->CQRing = mmap(NULL, queue->CQRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, queue->RingFD, IORING_OFF_CQ_RING);
+    	    if (queue->CQRing == MAP_FAILED) {
+    	    	delete queue;
+    	    	return NULL;
+	    }
+	}
+    	queue->SQEsSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    	queue->SQEs = (struct io_uring_sqe *)mmap(NULL, queue->SQEsSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, queue->RingFD, IORING_OFF_SQES);
+    	if (queue->SQEs == MAP_FAILED) {
+    	    delete queue;
+    	    return NULL;
+	}
+
+    	char *sq = (char *)queue->SQRing;
+    	char *cq = (char *)queue->CQRing;
+    	queue->SQTail  = (unsigned *)(sq + params.sq_off.tail);
+    	queue->SQMask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    	queue->SQArray = (unsigned *)(sq + params.sq_off.array);
+    	queue->CQHead  = (unsigned *)(cq + params.cq_off.head);
+    	queue->CQTail  = (unsigned *)(cq + params.cq_off.tail);
+    	queue->CQMask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    	queue->CQEs    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    	queue->Depth = params.sq_entries;
+    	queue->Requests.resize(queue->Depth);
+    	for (unsigned slot = queue->Depth; slot > 0; slot--) {
+    	    queue->FreeSlots.push_back(slot - 1);
+	}
+    	return queue;
+    }
+
+    ~UringQueue() {
+    	if (InFlight + Pending > 0) {
+    	    wait();
+	}
+    	if (SQEs != MAP_FAILED) {
+    	    munmap(SQEs, SQEsSize);
+	}
+    	if (CQRing != MAP_FAILED && CQRing != SQRing) {
+    	    munmap(CQRing, CQRingSize);
+	}
+    	if (SQRing != MAP_FAILED) {
+    	    munmap(SQRing, SQRingSize);
+	}
+    	if (RingFD >= 0) {
+    	    close(RingFD);
+	}
+    }
+
+    void submit(int fd, bool write, char *data, size_t length, off_t offset) {
+    	// Make room by waiting for the oldest requests when the ring is full
+    	while (FreeSlots.empty() && !Broken) {
+    	    enter(1);
+    	    reap();
+	}
+    	if (Broken) {
+    	    // Earlier requests finish first, the same blocks may be written again
+    	    drain();
+    	    if (!transfer(fd, write, data, length, offset) && !Error) {
+    	    	Error = errno;
+	    }
+    	    return;
+	}
+
+    	unsigned slot = FreeSlots.back();
+    	FreeSlots.pop_back();
+    	Request &request = Requests[slot];
+    	request.FD	     = fd;
+    	request.Write	     = write;
+    	request.IOV.iov_base = data;
+    	request.IOV.iov_len  = length;
+    	request.Offset	     = offset;
+
+    	unsigned tail = *SQTail;
+    	unsigned index = tail & *SQMask;
+    	struct io_uring_sqe *sqe = &SQEs[index];
+    	memset(sqe, 0, sizeof(*sqe));
+    	sqe->opcode    = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    	sqe->fd	       = fd;
+    	sqe->addr      = (unsigned long)&request.IOV;
+    	sqe->len       = 1;
+    	sqe->off       = offset;
+    	sqe->user_data = slot;
+    	SQArray[index] = index;
+    	__atomic_store_n(SQTail, tail + 1, __ATOMIC_RELEASE);
+    	Pending++;
+    }
+
+    bool wait() {
+    	while (Pending + InFlight > 0) {
+    	    enter(1);
+    	    if (Broken) {
+    	    	drain();
+	    } else {
+    	    	reap();
+	    }
+	}
+
+    	if (Error) {
+    	    errno = Error;
+    	    Error = 0;
+    	    return false;
+	}
+    	return true;
+    }
+
+    const char *name() const { return "io_uring"; }
+};
+
+// Thread pool queue ------------------------------------------------------------
+
+class ThreadPoolQueue : public IOQueue {
+private:
+    struct Request {
+    	int	FD;
+    	bool	Write;
+    	char   *Data;
+    	size_t	Length;
+    	off_t	Offset;
+    };
+
+    std::vector<std::thread>	Workers;
+    std::deque<Request>		Queue;
+    std::mutex			Lock;
+    std::condition_variable	Ready;	    // Signalled when requests are queued
+    std::condition_variable	Done;	    // Signalled when the queue drains
+    size_t			Outstanding;
+    bool			Stopping;
+    int				Error;
+
+    void work() {
+    	std::unique_lock<std::mutex> lock(Lock);
+    	while (true) {
+    	    Ready.wait(lock, [this] { return Stopping || !Queue.empty(); });
+    	    if (Queue.empty()) {
+    	    	return;
+	    }
+    	    Request request = Queue.front();
+    	    Queue.pop_front();
+
+    	    lock.unlock();
+    	    bool ok = transfer(request.FD, request.Write, request.Data, request.Length, request.Offset);
+    	    int error = errno;
+    	    lock.lock();
+
+    	    if (!ok && !Error) {
+    	    	Error = error;
+	    }
+    	    if (--Outstanding == 0) {
+    	    	Done.notify_all();
+	    }
+	}
+    }
+
+public:
+    ThreadPoolQueue(size_t depth) : Outstanding(0), Stopping(false), Error(0) {
+    	size_t workers = depth < 8 ? depth : 8;
+    	for (size_t i = 0; i < (workers ? workers : 1); i++) {
+    	    Workers.push_back(std::thread(&ThreadPoolQueue::work, this));
+	}
+    }
+
+    ~ThreadPoolQueue() {
+    	{
+    	    std::lock_guard<std::mutex> lock(Lock);
+    	    Stopping = true;
+	}
+    	Ready.notify_all();
+    	for (size_t i = 0; i < Workers.size(); i++) {
+    	    Workers[i].join();
+	}
+    }
+
+    void submit(int fd, bool write, char *data, size_t length, off_t offset) {
+    	Request request = {fd, write, data, length, offset};
+    	{
+    	    std::lock_guard<std::mutex> lock(Lock);
+    	    Queue.push_back(request);
+    	    Outstanding++;
+	}
+    	Ready.notify_one();
+    }
+
+    bool wait() {
+    	std::unique_lock<std::mutex> lock(Lock);
+    	Done.wait(lock, [this] { return Outstanding == 0; });
+    	if (Error) {
+    	    errno = Error;
+    	    Error = 0;
+    	    return false;
+	}
+    	return true;
+    }
+
+    const char *name() const { return "threads"; }
+};
+
+// Factory ----------------------------------------------------------------------
+
+IOQueue *IOQueue::create(size_t depth) {
+    IOQueue *queue = UringQueue::create(depth);
+    if (queue == NULL) {
+    	queue = new ThreadPoolQueue(depth);
+    }
+    return queue;
+}
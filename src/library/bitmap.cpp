@@ -0,0 +1,95 @@
+// bitmap.cpp: packed bitmap
+
+#include "sfs/bitmap.h"
+
+#include <stdexcept>
+
+#include <stdlib.h>
+#include <string.h>
+
+Bitmap::Bitmap(size_t bits) : Words(NULL), Bits(0), Set(0) {
+    reset(bits);
+}
+
+Bitmap::~Bitmap() {
+    free(Words);
+}
+
+void Bitmap::reset(size_t bits) {
+    size_t words = (bits + WORD_BITS - 1) / WORD_BITS;
+
+    free(Words);
+    Words = (uint64_t *)calloc(words ? words : 1, sizeof(uint64_t));
+    if (Words == NULL) {
+    	throw std::runtime_error("Unable to allocate bitmap");
+    }
+    Bits = bits;
+    Set  = 0;
+}
+
+void Bitmap::set(size_t bit) {
+    uint64_t mask = (uint64_t)1 << (bit % WORD_BITS);
+    if (!(Words[bit / WORD_BITS] & mask)) {
+    	Words[bit / WORD_BITS] |= mask;
+    	Set++;
+    }
+}
+
+void Bitmap::clear(size_t bit) {
+    uint64_t mask = (uint64_t)1 << (bit % WORD_BITS);
+    if (Words[bit / WORD_BITS] & mask) {
+    	Words[bit / WORD_BITS] &= ~mask;
+    	Set--;
+    }
+}
+
+void Bitmap::save(uint64_t *words) const {
+    memcpy(words, Words, this->words() * sizeof(uint64_t));
+}
+
+void Bitmap::load(const uint64_t *words) {
+    size_t n = this->words();
+    memcpy(Words, words, n * sizeof(uint64_t));
+
+    // Bits past the end never count as set
+    if (Bits % WORD_BITS) {
+    	Words[n - 1] &= ((uint64_t)1 << (Bits % WORD_BITS)) - 1;
+    }
+    Set = 0;
+    for (size_t w = 0; w < n; w++) {
+    	Set += __builtin_popcountll(Words[w]);
+    }
+}
+
+void Bitmap::merge(const Bitmap &other) {
+    size_t n = words();
+    Set = 0;
+    for (size_t w = 0; w < n; w++) {
+    	Words[w] |= other.Words[w];
+    	Set += __builtin_popcountll(Words[w]);
+    }
+}
+
+ssize_t Bitmap::find(size_t from, size_t to, bool value) const {
+    if (to > Bits) {
+    	to = Bits;
+    }
+    if (from >= to) {
+    	return -1;
+    }
+
+    // Look at one word at a time, inverting it when searching for clear bits
+    size_t   w    = from / WORD_BITS;
+    uint64_t word = value ? Words[w] : ~Words[w];
+    word &= ~(uint64_t)0 << (from % WORD_BITS);
+    while (true) {
+    	if (word) {
+    	    size_t bit = w * WORD_BITS + __builtin_ctzll(word);
+    	    return bit < to ? (ssize_t)bit : -1;
+	}
+    	if (++w * WORD_BITS >= to) {
+    	    return -1;
+	}
+    	word = value ? Words[w] : ~Words[w];
+    }
+}
@@ -0,0 +1,378 @@
+// cache.cpp: write-back block cache
+
+#include "sfs/cache.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <string.h>
+
+BlockCache::BlockCache(Disk *disk, size_t capacity)
+    : disk(disk), Capacity(capacity ? capacity : 1), Head(NULL), Tail(NULL),
+      Hits(0), Misses(0), Evictions(0), Writebacks(0),
+      Prefetches(0), ReadaheadHits(0), ReadaheadWasted(0), PinnedCount(0), Stalls(0) {
+    Entries = new Entry[Capacity];
+    Buffer  = (char *)malloc(Capacity * Disk::BLOCK_SIZE);
+    if (Buffer == NULL) {
+    	delete [] Entries;
+    	throw std::runtime_error("Unable to allocate block cache");
+    }
+
+    // All entries start out unused and are chained in LRU order
+    for (size_t i = 0; i < Capacity; i++) {
+    	Entries[i].BlockNumber = -1;
+    	Entries[i].Dirty       = false;
+    	Entries[i].Prefetched  = false;
+    	Entries[i].Pinned      = false;
+    	Entries[i].Committing  = false;
+    	Entries[i].Data        = Buffer + i * Disk::BLOCK_SIZE;
+    	Entries[i].Prev        = i > 0 ? &Entries[i - 1] : NULL;
+    	Entries[i].Next        = i + 1 < Capacity ? &Entries[i + 1] : NULL;
+    }
+    Head = &Entries[0];
+    Tail = &Entries[Capacity - 1];
+    Index.reserve(Capacity);
+}
+
+BlockCache::~BlockCache() {
+    flush();
+    free(Buffer);
+    delete [] Entries;
+}
+
+void BlockCache::unlink(Entry *entry) {
+    if (entry->Prev) {
+    	entry->Prev->Next = entry->Next;
+    } else {
+    	Head = entry->Next;
+    }
+    if (entry->Next) {
+    	entry->Next->Prev = entry->Prev;
+    } else {
+    	Tail = entry->Prev;
+    }
+    entry->Prev = entry->Next = NULL;
+}
+
+void BlockCache::touch(Entry *entry) {
+    if (entry == Head) {
+    	return;
+    }
+    unlink(entry);
+    entry->Next = Head;
+    if (Head) {
+    	Head->Prev = entry;
+    }
+    Head = entry;
+    if (Tail == NULL) {
+    	Tail = entry;
+    }
+}
+
+void BlockCache::hit(Entry *entry) {
+    Hits++;
+    if (entry->Prefetched) {
+    	entry->Prefetched = false;
+    	ReadaheadHits++;
+    }
+    touch(entry);
+}
+
+BlockCache::Entry *BlockCache::recycle() {
+    // A held block must not reach its place before the journal has logged it
+    Entry *entry = Tail;
+    while (entry && (entry->Pinned || entry->Committing)) {
+    	entry = entry->Prev;
+    }
+    if (entry == NULL) {
+    	return NULL;
+    }
+    if (entry->BlockNumber >= 0) {
+    	if (entry->Dirty) {
+    	    disk->write(entry->BlockNumber, entry->Data);
+    	    Writebacks++;
+	}
+    	if (entry->Prefetched) {
+    	    ReadaheadWasted++;
+	}
+    	Index.erase(entry->BlockNumber);
+    	Evictions++;
+    }
+
+    entry->BlockNumber = -1;
+    entry->Dirty       = false;
+    entry->Prefetched  = false;
+    return entry;
+}
+
+BlockCache::Entry *BlockCache::lookup(size_t blocknum, bool fill) {
+    Entry *entry = NULL;
+    while (entry == NULL) {
+    	std::unordered_map<size_t, Entry *>::iterator it = Index.find(blocknum);
+    	if (it != Index.end()) {
+    	    hit(it->second);
+    	    return it->second;
+	}
+
+    	// Recycle least recently used entry, writing it back if needed
+    	entry = recycle();
+    	if (entry == NULL) {
+    	    // Every entry is held: the commit in flight gives its blocks back (the block may
+    	    // have been cached meanwhile, so look it up again). Callers reserve room before
+    	    // they pin, so at most half of the entries are pinned and the rest are committing
+    	    if (!committing()) {
+    	    	throw std::logic_error("Block cache is full of blocks pinned for the journal");
+	    }
+    	    Stalls++;
+    	    Released.wait(Lock);
+	}
+    }
+    Misses++;
+    if (fill) {
+    	disk->read(blocknum, entry->Data);
+    }
+    entry->BlockNumber = blocknum;
+    Index[blocknum]    = entry;
+    touch(entry);
+    return entry;
+}
+
+void BlockCache::read_range(size_t blocknum, size_t offset, size_t length, char *data) {
+    std::lock_guard<std::mutex> lock(Lock);
+    std::unordered_map<size_t, Entry *>::iterator it = Index.find(blocknum);
+    if (it != Index.end()) {
+    	hit(it->second);
+    	memcpy(data, it->second->Data + offset, length);
+    	return;
+    }
+
+    // Mapped blocks are copied in place without taking a cache entry
+    const char *mapped = disk->view(blocknum);
+    if (mapped) {
+    	Misses++;
+    	memcpy(data, mapped + offset, length);
+    	return;
+    }
+    memcpy(data, lookup(blocknum, true)->Data + offset, length);
+}
+
+void BlockCache::write_range(size_t blocknum, size_t offset, size_t length, const char *data, bool zero) {
+    std::lock_guard<std::mutex> lock(Lock);
+    Entry *entry = lookup(blocknum, !zero);
+    if (zero) {
+    	memset(entry->Data, 0, Disk::BLOCK_SIZE);
+    }
+    memcpy(entry->Data + offset, data, length);
+    entry->Dirty = true;
+}
+
+void BlockCache::transfer_cached(size_t blocknum, size_t count, char *data, bool write, std::vector<Run> &misses) {
+    std::lock_guard<std::mutex> lock(Lock);
+    for (size_t i = 0; i < count; i++) {
+    	char *block = data + i * Disk::BLOCK_SIZE;
+    	std::unordered_map<size_t, Entry *>::iterator it = Index.find(blocknum + i);
+    	if (it == Index.end()) {
+    	    Misses++;
+    	    if (!misses.empty() && misses.back().BlockNumber + misses.back().Count == blocknum + i) {
+    	    	misses.back().Count++;
+	    } else {
+    	    	Run run = {blocknum + i, 1, block};
+    	    	misses.push_back(run);
+	    }
+    	    continue;
+	}
+
+    	hit(it->second);
+    	if (write) {
+    	    memcpy(it->second->Data, block, Disk::BLOCK_SIZE);
+    	    it->second->Dirty = true;
+	} else {
+    	    memcpy(block, it->second->Data, Disk::BLOCK_SIZE);
+	}
+    }
+}
+
+void BlockCache::read_blocks(size_t blocknum, size_t count, char *data) {
+    // Misses are read outside the lock so other threads keep using the cache
+    std::vector<Run> misses;
+    transfer_cached(blocknum, count, data, false, misses);
+    for (size_t i = 0; i < misses.size(); i++) {
+    	disk->submit_read(misses[i].BlockNumber, misses[i].Count, misses[i].Data);
+    }
+}
+
+void BlockCache::write_blocks(size_t blocknum, size_t count, char *data) {
+    std::vector<Run> misses;
+    transfer_cached(blocknum, count, data, true, misses);
+    for (size_t i = 0; i < misses.size(); i++) {
+    	disk->submit_write(misses[i].BlockNumber, misses[i].Count, misses[i].Data);
+    }
+}
+
+void BlockCache::insert(size_t blocknum, const char *data) {
+    std::lock_guard<std::mutex> lock(Lock);
+    // Unused entries are never touched, so they collect at the tail
+    if (Tail->BlockNumber >= 0 || Index.count(blocknum)) {
+    	return;
+    }
+    Entry *entry = Tail;
+    memcpy(entry->Data, data, Disk::BLOCK_SIZE);
+    entry->BlockNumber = blocknum;
+    entry->Dirty       = false;
+    Index[blocknum]    = entry;
+    touch(entry);
+}
+
+void BlockCache::prefetch(size_t blocknum, size_t count) {
+    // Collect runs of uncached blocks, read into private buffers outside the lock
+    std::vector<Run> runs;
+    {
+    	std::lock_guard<std::mutex> lock(Lock);
+    	if (count > Capacity / 2) {
+    	    count = Capacity / 2;
+	}
+    	for (size_t i = 0; i < count; i++) {
+    	    if (Index.count(blocknum + i)) {
+    	    	continue;
+	    }
+    	    if (!runs.empty() && runs.back().BlockNumber + runs.back().Count == blocknum + i) {
+    	    	runs.back().Count++;
+	    } else {
+    	    	Run run = {blocknum + i, 1, NULL};
+    	    	runs.push_back(run);
+	    }
+	}
+    }
+    if (runs.empty()) {
+    	return;
+    }
+
+    size_t blocks = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+    	blocks += runs[i].Count;
+    }
+    std::vector<char> buffer(blocks * Disk::BLOCK_SIZE);
+    char *data = &buffer[0];
+    for (size_t i = 0; i < runs.size(); i++) {
+    	runs[i].Data = data;
+    	disk->submit_read(runs[i].BlockNumber, runs[i].Count, data);
+    	data += runs[i].Count * Disk::BLOCK_SIZE;
+    }
+    disk->wait();
+
+    // Blocks cached by someone else in the meantime are left alone
+    std::lock_guard<std::mutex> lock(Lock);
+    for (size_t i = 0; i < runs.size(); i++) {
+    	for (size_t j = 0; j < runs[i].Count; j++) {
+    	    if (Index.count(runs[i].BlockNumber + j)) {
+    	    	continue;
+	    }
+    	    Entry *entry = recycle();
+    	    if (entry == NULL) {
+    	    	// Read-ahead never waits for the journal
+    	    	return;
+	    }
+    	    memcpy(entry->Data, runs[i].Data + j * Disk::BLOCK_SIZE, Disk::BLOCK_SIZE);
+    	    entry->BlockNumber = runs[i].BlockNumber + j;
+    	    entry->Prefetched  = true;
+    	    Index[entry->BlockNumber] = entry;
+    	    touch(entry);
+    	    Prefetches++;
+	}
+    }
+}
+
+void BlockCache::write_pinned(size_t blocknum, size_t offset, size_t length, const char *data) {
+    std::lock_guard<std::mutex> lock(Lock);
+    Entry *entry = lookup(blocknum, length < Disk::BLOCK_SIZE);
+    memcpy(entry->Data + offset, data, length);
+    entry->Dirty = true;
+    if (!entry->Pinned) {
+    	entry->Pinned = true;
+    	PinnedCount++;
+    }
+}
+
+void BlockCache::collect(std::vector<size_t> &blocks, std::vector<char> &images) {
+    std::lock_guard<std::mutex> lock(Lock);
+    for (size_t i = 0; i < Capacity; i++) {
+    	Entry *entry = &Entries[i];
+    	if (!entry->Pinned) {
+    	    continue;
+	}
+    	blocks.push_back(entry->BlockNumber);
+    	images.insert(images.end(), entry->Data, entry->Data + Disk::BLOCK_SIZE);
+    	entry->Pinned     = false;
+    	entry->Committing = true;
+    	PinnedCount--;
+    }
+}
+
+void BlockCache::release() {
+    std::lock_guard<std::mutex> lock(Lock);
+    for (size_t i = 0; i < Capacity; i++) {
+    	Entries[i].Committing = false;
+    }
+    Released.notify_all();
+}
+
+bool BlockCache::committing() const {
+    for (size_t i = 0; i < Capacity; i++) {
+    	if (Entries[i].Committing) {
+    	    return true;
+	}
+    }
+    return false;
+}
+
+bool BlockCache::held(size_t blocknum) {
+    std::lock_guard<std::mutex> lock(Lock);
+    std::unordered_map<size_t, Entry *>::iterator it = Index.find(blocknum);
+    return it != Index.end() && (it->second->Pinned || it->second->Committing);
+}
+
+void BlockCache::reset_stats() {
+    std::lock_guard<std::mutex> lock(Lock);
+    Hits = Misses = Evictions = Writebacks = Stalls = 0;
+    Prefetches = ReadaheadHits = ReadaheadWasted = 0;
+}
+
+void BlockCache::wait() {
+    disk->wait();
+}
+
+void BlockCache::flush() {
+    std::lock_guard<std::mutex> lock(Lock);
+
+    // Write back in block order so the disk sees ascending offsets
+    std::vector<Entry *> dirty;
+    for (size_t i = 0; i < Capacity; i++) {
+    	if (Entries[i].BlockNumber >= 0 && Entries[i].Dirty && !Entries[i].Pinned && !Entries[i].Committing) {
+    	    dirty.push_back(&Entries[i]);
+	}
+    }
+    std::sort(dirty.begin(), dirty.end(), [](const Entry *a, const Entry *b) {
+    	return a->BlockNumber < b->BlockNumber;
+    });
+
+    // Each run of consecutive blocks goes out as one vectored write
+    std::vector<char *> buffers;
+    for (size_t i = 0; i < dirty.size(); ) {
+    	size_t run = 1;
+    	while (i + run < dirty.size() && dirty[i + run]->BlockNumber == dirty[i]->BlockNumber + (ssize_t)run) {
+    	    run++;
+	}
+
+    	buffers.clear();
+    	for (size_t j = i; j < i + run; j++) {
+    	    buffers.push_back(dirty[j]->Data);
+	}
+    	disk->writev(dirty[i]->BlockNumber, run, &buffers[0]);
+    	for (size_t j = i; j < i + run; j++) {
+    	    dirty[j]->Dirty = false;
+	}
+    	Writebacks += run;
+    	i += run;
+    }
+}
@@ -1,15 +1,194 @@
 // disk.cpp: disk emulator
 
 #include "sfs/disk.h"
+#include "sfs/latencydisk.h"
+#include "sfs/ramdisk.h"
+#include "sfs/stats.h"
 
+#include <memory>
 #include <stdexcept>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-void Disk::open(const char *path, size_t nblocks) {
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+// Disk
+
+Disk *Disk::create(const char *backend, const char *path, size_t nblocks) {
+    if (streq(backend, "file") || streq(backend, "mmap") || streq(backend, "async")) {
+    	std::unique_ptr<FileDisk> disk(new FileDisk());
+    	disk->open(path, nblocks, streq(backend, "mmap") ? FileDisk::MMAP_IO : streq(backend, "async") ? FileDisk::ASYNC_IO : FileDisk::FILE_IO);
+    	return disk.release();
+    }
+
+    if (streq(backend, "ram") || streq(backend, "ssd") || streq(backend, "hdd")) {
+    	std::unique_ptr<RamDisk> disk(new RamDisk());
+    	disk->open(path, nblocks);
+    	if (streq(backend, "ram")) {
+    	    return disk.release();
+	}
+    	return new LatencyDisk(disk.release(), streq(backend, "ssd") ? LatencyDisk::SSD : LatencyDisk::HDD);
+    }
+
+    return NULL;
+}
+
+Disk::~Disk() {
+    if (Blocks > 0 && !Wrapped) {
+    	printf("%lu disk block reads\n", Reads.load());
+    	printf("%lu disk block writes\n", Writes.load());
+    }
+}
+
+void Disk::sanity_check(size_t blocknum, const char *data) {
+    char what[BUFSIZ];
+
+    if (blocknum >= Blocks) {
+    	snprintf(what, BUFSIZ, "blocknum (%lu) is too big!", blocknum);
+    	throw std::invalid_argument(what);
+    }
+
+    if (data == NULL) {
+    	snprintf(what, BUFSIZ, "null data pointer!");
+    	throw std::invalid_argument(what);
+    }
+}
+
+void Disk::sanity_check_run(size_t blocknum, size_t count) {
+    char what[BUFSIZ];
+
+    if (count > Blocks || blocknum > Blocks - count) {
+    	snprintf(what, BUFSIZ, "block run (%lu, %lu) is too big!", blocknum, count);
+    	throw std::invalid_argument(what);
+    }
+}
+
+void Disk::read(size_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+    StatsTimer timer(Stats::DISK_READ);
+    Stats::transferred(Stats::DISK_READ, BLOCK_SIZE);
+    transfer_blocks(blocknum, 1, data, false);
+    Reads++;
+}
+
+void Disk::write(size_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+    StatsTimer timer(Stats::DISK_WRITE);
+    Stats::transferred(Stats::DISK_WRITE, BLOCK_SIZE);
+    transfer_blocks(blocknum, 1, data, true);
+    Writes++;
+}
+
+void Disk::read_blocks(size_t blocknum, size_t count, char *data) {
+    sanity_check(blocknum, data);
+    sanity_check_run(blocknum, count);
+    StatsTimer timer(Stats::DISK_READ);
+    Stats::transferred(Stats::DISK_READ, count*BLOCK_SIZE);
+    transfer_blocks(blocknum, count, data, false);
+    Reads += count;
+}
+
+void Disk::write_blocks(size_t blocknum, size_t count, char *data) {
+    sanity_check(blocknum, data);
+    sanity_check_run(blocknum, count);
+    StatsTimer timer(Stats::DISK_WRITE);
+    Stats::transferred(Stats::DISK_WRITE, count*BLOCK_SIZE);
+    transfer_blocks(blocknum, count, data, true);
+    Writes += count;
+}
+
+void Disk::readv(size_t blocknum, size_t count, char **buffers) {
+    sanity_check_run(blocknum, count);
+    StatsTimer timer(Stats::DISK_READ);
+    Stats::transferred(Stats::DISK_READ, count*BLOCK_SIZE);
+    transfer_vector(blocknum, count, buffers, false);
+    Reads += count;
+}
+
+void Disk::writev(size_t blocknum, size_t count, char **buffers) {
+    sanity_check_run(blocknum, count);
+    StatsTimer timer(Stats::DISK_WRITE);
+    Stats::transferred(Stats::DISK_WRITE, count*BLOCK_SIZE);
+    transfer_vector(blocknum, count, buffers, true);
+    Writes += count;
+}
+
+void Disk::submit_read(size_t blocknum, size_t count, char *data) {
+    sanity_check(blocknum, data);
+    sanity_check_run(blocknum, count);
+    // Only the time to queue the request is known here if the disk queues it
+    StatsTimer timer(Stats::DISK_READ);
+    Stats::transferred(Stats::DISK_READ, count*BLOCK_SIZE);
+    submit_blocks(blocknum, count, data, false);
+    Reads += count;
+}
+
+void Disk::submit_write(size_t blocknum, size_t count, char *data) {
+    sanity_check(blocknum, data);
+    sanity_check_run(blocknum, count);
+    // Only the time to queue the request is known here if the disk queues it
+    StatsTimer timer(Stats::DISK_WRITE);
+    Stats::transferred(Stats::DISK_WRITE, count*BLOCK_SIZE);
+    submit_blocks(blocknum, count, data, true);
+    Writes += count;
+}
+
+void Disk::transfer_vector(size_t blocknum, size_t count, char **buffers, bool write) {
+    for (size_t i = 0; i < count; i++) {
+    	transfer_blocks(blocknum + i, 1, buffers[i], write);
+    }
+}
+
+void Disk::submit_blocks(size_t blocknum, size_t count, char *data, bool write) {
+    transfer_blocks(blocknum, count, data, write);
+}
+
+const char *Disk::map_block(size_t blocknum) {
+    (void)blocknum;
+    return NULL;
+}
+
+bool Disk::discard(size_t blocknum, size_t count) {
+    sanity_check_run(blocknum, count);
+    return count == 0;
+}
+
+void Disk::zero(size_t blocknum, size_t count) {
+    if (discard(blocknum, count)) {
+    	return;
+    }
+
+    const size_t chunk = 256;
+    char *zeros = (char *)calloc(chunk, BLOCK_SIZE);
+    if (zeros == NULL) {
+    	throw std::runtime_error("Unable to allocate zero blocks");
+    }
+    for (size_t done = 0; done < count; done += chunk) {
+    	write_blocks(blocknum + done, count - done < chunk ? count - done : chunk, zeros);
+    }
+    free(zeros);
+}
+
+const char *Disk::view(size_t blocknum) {
+    if (!mapped()) {
+    	return NULL;
+    }
+    sanity_check_run(blocknum, 1);
+    StatsTimer timer(Stats::DISK_READ);
+    Stats::transferred(Stats::DISK_READ, BLOCK_SIZE);
+    Reads++;
+    return map_block(blocknum);
+}
+
+// FileDisk
+
+void FileDisk::open(const char *path, size_t nblocks, Backend backend, size_t depth) {
     FileDescriptor = ::open(path, O_RDWR|O_CREAT, 0600);
     if (FileDescriptor < 0) {
     	char what[BUFSIZ];
@@ -17,77 +196,191 @@ void Disk::open(const char *path, size_t nblocks) {
     	throw std::runtime_error(what);
     }
 
-    if (ftruncate(FileDescriptor, nblocks*BLOCK_SIZE) < 0) {
+    if (ftruncate(FileDescriptor, (off_t)nblocks*BLOCK_SIZE) < 0) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
     	throw std::runtime_error(what);
     }
 
+    IOBackend = FILE_IO;
+    if (backend == MMAP_IO && nblocks > 0) {
+    	void *mapping = mmap(NULL, nblocks*BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, FileDescriptor, 0);
+    	if (mapping == MAP_FAILED) {
+    	    fprintf(stderr, "Unable to map %s: %s (using file I/O)\n", path, strerror(errno));
+	} else {
+    	    Mapping   = (char *)mapping;
+    	    IOBackend = MMAP_IO;
+	}
+    } else if (backend == ASYNC_IO) {
+    	Queue     = IOQueue::create(depth);
+    	IOBackend = ASYNC_IO;
+    }
+
     Blocks = nblocks;
-    Reads  = 0;
-    Writes = 0;
 }
 
-Disk::~Disk() {
+FileDisk::~FileDisk() {
     if (FileDescriptor > 0) {
-    	printf("%lu disk block reads\n", Reads);
-    	printf("%lu disk block writes\n", Writes);
+    	if (Queue) {
+    	    Queue->wait();
+    	    delete Queue;
+    	    Queue = NULL;
+	}
+    	if (Mapping) {
+    	    msync(Mapping, Blocks*BLOCK_SIZE, MS_SYNC);
+    	    munmap(Mapping, Blocks*BLOCK_SIZE);
+    	    Mapping = NULL;
+	}
     	close(FileDescriptor);
     	FileDescriptor = 0;
     }
 }
 
-void Disk::sanity_check(int blocknum, char *data) {
-    char what[BUFSIZ];
-
-    if (blocknum < 0) {
-    	snprintf(what, BUFSIZ, "blocknum (%d) is negative!", blocknum);
-    	throw std::invalid_argument(what);
+const char *FileDisk::name() const {
+    switch (IOBackend) {
+    	case MMAP_IO:  return "mmap";
+    	case ASYNC_IO: return "async";
+    	default:       return "file";
     }
+}
 
-    if (blocknum >= (int)Blocks) {
-    	snprintf(what, BUFSIZ, "blocknum (%d) is too big!", blocknum);
-    	throw std::invalid_argument(what);
-    }
+// Transfer every byte described by iov at offset, resuming partial transfers
+static bool transfer(int fd, struct iovec *iov, int iovcnt, off_t offset, bool write) {
+    while (iovcnt > 0) {
+    	ssize_t n = write ? pwritev(fd, iov, iovcnt, offset) : preadv(fd, iov, iovcnt, offset);
+    	if (n < 0 && errno == EINTR) {
+    	    continue;
+	}
+    	if (n <= 0) {
+    	    if (n == 0) {
+    	    	errno = EIO;
+	    }
+    	    return false;
+	}
 
-    if (data == NULL) {
-    	snprintf(what, BUFSIZ, "null data pointer!");
-    	throw std::invalid_argument(what);
+    	offset += n;
+    	while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+    	    n -= iov->iov_len;
+    	    iov++;
+    	    iovcnt--;
+	}
+    	if (iovcnt > 0) {
+    	    iov->iov_base = (char *)iov->iov_base + n;
+    	    iov->iov_len -= n;
+	}
     }
+    return true;
 }
 
-void Disk::read(int blocknum, char *data) {
-    sanity_check(blocknum, data);
+void FileDisk::transfer_blocks(size_t blocknum, size_t count, char *data, bool write) {
+    if (Mapping) {
+    	char *blocks = Mapping + (off_t)blocknum*BLOCK_SIZE;
+    	if (write) {
+    	    memcpy(blocks, data, count*BLOCK_SIZE);
+	} else {
+    	    memcpy(data, blocks, count*BLOCK_SIZE);
+	}
+    	return;
+    }
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    struct iovec iov = {data, count*BLOCK_SIZE};
+    if (!transfer(FileDescriptor, &iov, 1, (off_t)blocknum*BLOCK_SIZE, write)) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
+    	if (count == 1) {
+    	    snprintf(what, BUFSIZ, "Unable to %s %lu: %s", write ? "write" : "read", blocknum, strerror(errno));
+	} else {
+    	    snprintf(what, BUFSIZ, "Unable to %s %lu-%lu: %s", write ? "write" : "read", blocknum, blocknum + count - 1, strerror(errno));
+	}
     	throw std::runtime_error(what);
     }
+}
 
-    if (::read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+void FileDisk::transfer_vector(size_t blocknum, size_t count, char **buffers, bool write) {
+    if (Mapping) {
+    	Disk::transfer_vector(blocknum, count, buffers, write);
+    	return;
     }
 
-    Reads++;
+    // Split the request into batches of at most IOV_MAX buffers
+    struct iovec iov[IOV_MAX];
+    for (size_t done = 0; done < count; ) {
+    	size_t batch = count - done < IOV_MAX ? count - done : IOV_MAX;
+    	for (size_t i = 0; i < batch; i++) {
+    	    iov[i].iov_base = buffers[done + i];
+    	    iov[i].iov_len  = BLOCK_SIZE;
+	}
+    	if (!transfer(FileDescriptor, iov, batch, (off_t)(blocknum + done)*BLOCK_SIZE, write)) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to %s %lu-%lu: %s", write ? "write" : "read", blocknum + done, blocknum + done + batch - 1, strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    	done += batch;
+    }
 }
 
-void Disk::write(int blocknum, char *data) {
-    sanity_check(blocknum, data);
+void FileDisk::submit_blocks(size_t blocknum, size_t count, char *data, bool write) {
+    if (Queue == NULL) {
+    	transfer_blocks(blocknum, count, data, write);
+    	return;
+    }
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    std::lock_guard<std::mutex> lock(QueueLock);
+    Queue->submit(FileDescriptor, write, data, count*BLOCK_SIZE, (off_t)blocknum*BLOCK_SIZE);
+}
+
+const char *FileDisk::map_block(size_t blocknum) {
+    return Mapping ? Mapping + (off_t)blocknum*BLOCK_SIZE : NULL;
+}
+
+void FileDisk::wait() {
+    if (Queue == NULL) {
+    	return;
+    }
+
+    std::lock_guard<std::mutex> lock(QueueLock);
+    if (!Queue->wait()) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to complete queued I/O: %s", strerror(errno));
     	throw std::runtime_error(what);
     }
+}
 
-    if (::write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+bool FileDisk::discard(size_t blocknum, size_t count) {
+    sanity_check_run(blocknum, count);
+    if (count == 0) {
+    	return true;
+    }
+
+    off_t offset = (off_t)blocknum*BLOCK_SIZE;
+    off_t length = (off_t)count*BLOCK_SIZE;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(FileDescriptor, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+    	return true;
+    }
+#endif
+#ifdef FALLOC_FL_ZERO_RANGE
+    if (fallocate(FileDescriptor, FALLOC_FL_ZERO_RANGE, offset, length) == 0) {
+    	return true;
+    }
+#endif
+    // The end of the image can always be cut off and grown back as a hole
+    if (blocknum + count == Blocks && ftruncate(FileDescriptor, offset) == 0) {
+    	if (ftruncate(FileDescriptor, (off_t)Blocks*BLOCK_SIZE) < 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to regrow image: %s", strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    	return true;
+    }
+    return false;
+}
+
+void FileDisk::sync() {
+    wait();
+    int result = Mapping ? msync(Mapping, Blocks*BLOCK_SIZE, MS_SYNC) : fdatasync(FileDescriptor);
+    if (result < 0) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to sync: %s", strerror(errno));
     	throw std::runtime_error(what);
     }
-
-    Writes++;
 }
@@ -1,191 +1,841 @@
 // fs.cpp: File System
 
 #include "sfs/fs.h"
+#include "sfs/stats.h"
 
 #include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
 
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 #include <malloc.h>
 
 // Debug file system -----------------------------------------------------------
 
 void FileSystem::debug(Disk *disk) {
     Block block;
+    SuperBlock super;
 
     // Read Superblock
     disk->read(0, block.Data);
+    load_superblock(block, &super);
     printf("SuperBlock:\n");
-    if(block.Super.MagicNumber == MAGIC_NUMBER){
+    if(super.MagicNumber == MAGIC_NUMBER){
         printf("    magic number is valid\n");
-        printf("    %u blocks\n"         , block.Super.Blocks);
-        printf("    %u inode blocks\n"   , block.Super.InodeBlocks);
-        printf("    %u inodes\n"         , block.Super.Inodes);
+        if(super.BlockSize && super.BlockSize != Geometry::SIZE){
+            //the rest is laid out in blocks of another size
+            printf("    block size %lu is not supported\n", super.BlockSize);
+            return;
+        }
+        printf("    %lu blocks\n"        , super.Blocks);
+        printf("    %lu inode blocks\n"  , super.InodeBlocks);
+        printf("    %lu inodes\n"        , super.Inodes);
+        if(super.JournalBlocks){
+            printf("    %lu journal blocks\n", super.JournalBlocks);
+        }
+        if(super.ReservedBlocks){
+            printf("    %lu reserved blocks\n", super.ReservedBlocks);
+        }
+        if(super.Version != POINTER_VERSION){
+            printf("    version %u\n"       , super.Version);
+        }
     }
 
     // Read Inode blocks
-    uint32_t bnum = 1;//block number
-    uint32_t inum = 0;//inode number, starts from 0 now
-    Block inodeBlock;
-    for(; bnum <= block.Super.InodeBlocks; bnum++){
-        disk->read(bnum, inodeBlock.Data);
-        uint32_t j = 0;
-        for(; j < INODES_PER_BLOCK; j++, inum++){
-            Inode inode = inodeBlock.Inodes[j];
+    size_t inodeSize = inode_size(super.Version);
+    uint64_t bnum = 1;//block number
+    uint64_t inum = 0;//inode number, starts from 0 now
+    Block inodeBuffer;
+    size_t files = 0;//files with data blocks
+    size_t runs = 0;//physically contiguous runs of their data blocks
+    for(; bnum <= super.InodeBlocks && bnum < disk->size(); bnum++){
+        if(super.InodeInitEnd && bnum >= super.InodeInitEnd){
+            //the rest of the inode blocks have not been zeroed yet and hold no inodes
+            break;
+        }
+        const Block *inodeBlock = view_block(disk, bnum, &inodeBuffer);
+        size_t j = 0;
+        for(; j < Disk::BLOCK_SIZE / inodeSize; j++, inum++){
+            Inode inode;
+            load_inode(inodeBlock->Data + j * inodeSize, super.Version, &inode);
             if(inode.Valid){
-                printf("Inode %u:\n", inum);
-                printf("    size: %u bytes\n", inode.Size);
+                printf("Inode %lu:\n", inum);
+                printf("    size: %lu bytes\n", inode.Size);
+                if(super.Version == INLINE_VERSION && inode.ExtentCount == 0 && inode.Size && inode.Size <= INLINE_DATA){
+                    printf("    inline data\n");
+                    continue;
+                }
+                size_t fileRuns = 0;
+                if(super.Version != POINTER_VERSION){
+                    fileRuns = debug_extents(disk, super.Version, inode);
+                    files += fileRuns != 0;
+                    runs += fileRuns;
+                    continue;
+                }
                 uint32_t k = 0;
+                uint32_t last = 0;//previous data block, a run goes on where it is followed by the next block
                 printf("    direct blocks:");
                 for(; k < POINTERS_PER_INODE; k++){
                     if(inode.Direct[k]){
                         printf(" %u", inode.Direct[k]);
+                        fileRuns += inode.Direct[k] != last + 1;
+                        last = inode.Direct[k];
                     }
                 }
                 printf("\n");
                 if(inode.Indirect){
                     printf("    indirect block: %u\n    indirect data blocks:", inode.Indirect);
-                    Block pointerBlock;
-                    disk->read(inode.Indirect, pointerBlock.Data);
+                    Block pointerBuffer;
+                    const Block *pointerBlock = view_block(disk, inode.Indirect, &pointerBuffer);
                     for(k = 0; k < POINTERS_PER_BLOCK; k++){
-                        if(pointerBlock.Pointers[k]){
-                            printf(" %u", pointerBlock.Pointers[k]);
+                        if(pointerBlock->Pointers[k]){
+                            printf(" %u", pointerBlock->Pointers[k]);
+                            fileRuns += pointerBlock->Pointers[k] != last + 1;
+                            last = pointerBlock->Pointers[k];
                         }
                     }
                     printf("\n");
                 }
+                files += fileRuns != 0;
+                runs += fileRuns;
             }
         }
     }
+    if(files){
+        //how well the allocator kept each file together: 1.00 means every file is one run
+        printf("Fragmentation:\n");
+        printf("    %lu extents in %lu files (%.2f extents per file)\n", runs, files, (double)runs / files);
+    }
     // printf("%lu disk block reads\n", disk->getReads());
     // printf("%lu disk block writes\n", disk->getWrites());
 }
 
+//print the extents of @inode (first block-last block, holes as hole:length) and its extent blocks,
+//return the number of extents holding data
+size_t FileSystem::debug_extents(Disk *disk, uint32_t version, const Inode &inode){
+    std::vector<Extent> extents(inode.Extents, inode.Extents + (inode.ExtentCount < INLINE_EXTENTS ? inode.ExtentCount : INLINE_EXTENTS));
+    std::vector<uint64_t> extentBlocks;
+    uint64_t next = inode.Overflow;
+    Block extentBuffer;
+    while(extents.size() < inode.ExtentCount && next && next < disk->size() && extentBlocks.size() < inode.ExtentCount){
+        extentBlocks.push_back(next);
+        load_extent_block(view_block(disk, next, &extentBuffer), version, extents, &next);
+    }
+    printf("    extents:");
+    size_t n = 0;
+    size_t runs = 0;
+    for(; n < extents.size() && n < inode.ExtentCount; n++){
+        print_extent(extents[n]);
+        runs += extents[n].Start != 0;
+    }
+    printf("\n");
+    if(!extentBlocks.empty()){
+        printf("    extent blocks:");
+        for(n = 0; n < extentBlocks.size(); n++){
+            printf(" %lu", extentBlocks[n]);
+        }
+        printf("\n");
+    }
+    return runs;
+}
+
+void FileSystem::print_extent(const Extent &extent){
+    if(extent.Start){
+        printf(" %lu-%lu", extent.Start, extent.Start + extent.Length - 1);
+    }
+    else{
+        printf(" hole:%lu", extent.Length);
+    }
+}
+
+//return block @blocknum in place if @disk is memory-mapped, otherwise read it into @buffer
+const FileSystem::Block *FileSystem::view_block(Disk *disk, size_t blocknum, Block *buffer){
+    const char *mapped = disk->view(blocknum);
+    if(mapped){
+        return (const Block *)mapped;
+    }
+    disk->read(blocknum, buffer->Data);
+    return buffer;
+}
+
+// On-disk formats -------------------------------------------------------------
+
+//inode blocks of a file system of @blocks blocks in inode format @version: enough for @options.Inodes
+//inodes, else for one inode per @options.BytesPerInode bytes of disk, else a tenth of the blocks, rounded up
+uint64_t FileSystem::inode_blocks(uint64_t blocks, uint32_t version, const FormatOptions &options){
+    uint64_t inodes = options.Inodes;
+    if(inodes == 0 && options.BytesPerInode){
+        //blocks * BLOCK_SIZE / BytesPerInode without overflowing
+        uint64_t perInode = options.BytesPerInode;
+        inodes = blocks / perInode * Geometry::SIZE + blocks % perInode * Geometry::SIZE / perInode;
+        if(inodes == 0){
+            inodes = 1;
+        }
+    }
+    if(inodes == 0){
+        return blocks / 10 + (blocks % 10 != 0);
+    }
+    uint64_t perBlock = Geometry::SIZE / inode_size(version);
+    return inodes / perBlock + (inodes % perBlock != 0);
+}
+
+//bytes per inode on disk in inode format @version
+size_t FileSystem::inode_size(uint32_t version){
+    if(version == INLINE_VERSION){
+        return Disk::BLOCK_SIZE / INODES_PER_BLOCK_INLINE;
+    }
+    return version == EXTENT64_VERSION ? sizeof(Inode) : sizeof(Inode32);
+}
+
+//extents per extent block in inode format @version
+size_t FileSystem::extents_per_block(uint32_t version){
+    return version >= EXTENT64_VERSION ? EXTENTS_PER_BLOCK_64 : EXTENTS_PER_BLOCK;
+}
+
+//decode the superblock in @block, widening the fields of the 32-bit versions
+void FileSystem::load_superblock(const Block &block, SuperBlock *super){
+    if(block.Super.Version >= EXTENT64_VERSION){
+        *super = block.Super;
+        return;
+    }
+    const SuperBlock32 &super32 = block.Super32;
+    *super = SuperBlock();
+    super->MagicNumber  = super32.MagicNumber;
+    super->Version      = super32.Version;
+    super->Clean        = super32.Clean;
+    super->Blocks       = super32.Blocks;
+    super->InodeBlocks  = super32.InodeBlocks;
+    super->Inodes       = super32.Inodes;
+    super->BitmapStart  = super32.BitmapStart;
+    super->BitmapBlocks = super32.BitmapBlocks;
+    super->InodeInitEnd = super32.InodeInitEnd;
+    super->JournalStart = super32.JournalStart;
+    super->JournalBlocks = super32.JournalBlocks;
+    super->BlockSize    = super32.BlockSize;
+    super->ReservedBlocks = super32.ReservedBlocks;
+}
+
+//encode @super into @block in the layout of its version
+void FileSystem::store_superblock(const SuperBlock &super, Block *block){
+    memset(block->Data, 0, Disk::BLOCK_SIZE);
+    if(super.Version >= EXTENT64_VERSION){
+        block->Super = super;
+        return;
+    }
+    SuperBlock32 &super32 = block->Super32;
+    super32.MagicNumber  = super.MagicNumber;
+    super32.Version      = super.Version;
+    super32.Clean        = super.Clean;
+    super32.Blocks       = super.Blocks;
+    super32.InodeBlocks  = super.InodeBlocks;
+    super32.Inodes       = super.Inodes;
+    super32.BitmapStart  = super.BitmapStart;
+    super32.BitmapBlocks = super.BitmapBlocks;
+    super32.InodeInitEnd = super.InodeInitEnd;
+    super32.JournalStart = super.JournalStart;
+    super32.JournalBlocks = super.JournalBlocks;
+    super32.BlockSize    = super.BlockSize;
+    super32.ReservedBlocks = super.ReservedBlocks;
+}
+
+//decode the on-disk inode at @raw into the in-core @inode
+void FileSystem::load_inode(const char *raw, uint32_t version, Inode *inode){
+    if(version >= EXTENT64_VERSION){
+        memcpy(inode, raw, sizeof(Inode));
+        return;
+    }
+    Inode32 inode32;
+    memcpy(&inode32, raw, sizeof(Inode32));
+    memset(inode, 0, sizeof(Inode));
+    inode->Valid = inode32.Valid;
+    inode->Size = inode32.Size;
+    if(version == POINTER_VERSION){
+        memcpy(inode->Direct, inode32.Direct, sizeof(inode32.Direct));
+        inode->Indirect = inode32.Indirect;
+        return;
+    }
+    inode->ExtentCount = inode32.ExtentCount;
+    inode->Overflow = inode32.Overflow;
+    uint32_t n = 0;
+    for(; n < INLINE_EXTENTS; n++){
+        inode->Extents[n].Start = inode32.Extents[n].Start;
+        inode->Extents[n].Length = inode32.Extents[n].Length;
+    }
+}
+
+//encode the in-core @inode into the on-disk inode at @raw
+void FileSystem::store_inode(const Inode &inode, uint32_t version, char *raw){
+    if(version >= EXTENT64_VERSION){
+        memcpy(raw, &inode, sizeof(Inode));
+        return;
+    }
+    Inode32 inode32;
+    memset(&inode32, 0, sizeof(Inode32));
+    inode32.Valid = inode.Valid;
+    inode32.Size = inode.Size;
+    if(version == POINTER_VERSION){
+        memcpy(inode32.Direct, inode.Direct, sizeof(inode32.Direct));
+        inode32.Indirect = inode.Indirect;
+    }
+    else{
+        inode32.ExtentCount = inode.ExtentCount;
+        inode32.Overflow = inode.Overflow;
+        uint32_t n = 0;
+        for(; n < INLINE_EXTENTS; n++){
+            inode32.Extents[n].Start = inode.Extents[n].Start;
+            inode32.Extents[n].Length = inode.Extents[n].Length;
+        }
+    }
+    memcpy(raw, &inode32, sizeof(Inode32));
+}
+
+//append the extents used in extent @block to @extents and set *@next to the next block of the chain
+void FileSystem::load_extent_block(const Block *block, uint32_t version, std::vector<Extent> &extents, uint64_t *next){
+    if(version >= EXTENT64_VERSION){
+        const ExtentBlock &extentBlock = block->Overflow;
+        uint64_t count = extentBlock.Count < EXTENTS_PER_BLOCK_64 ? extentBlock.Count : EXTENTS_PER_BLOCK_64;
+        extents.insert(extents.end(), extentBlock.Extents, extentBlock.Extents + count);
+        *next = extentBlock.Next;
+        return;
+    }
+    const ExtentBlock32 &extentBlock = block->Overflow32;
+    uint32_t i = 0;
+    for(; i < extentBlock.Count && i < EXTENTS_PER_BLOCK; i++){
+        Extent extent = {extentBlock.Extents[i].Start, extentBlock.Extents[i].Length};
+        extents.push_back(extent);
+    }
+    *next = extentBlock.Next;
+}
+
+//fill extent @block with the @count (at most extents_per_block) extents at @extents, chained to @next
+void FileSystem::store_extent_block(const Extent *extents, size_t count, uint64_t next, uint32_t version, Block *block){
+    memset(block->Data, 0, Disk::BLOCK_SIZE);
+    if(version >= EXTENT64_VERSION){
+        std::copy(extents, extents + count, block->Overflow.Extents);
+        block->Overflow.Count = count;
+        block->Overflow.Next = next;
+        return;
+    }
+    size_t i = 0;
+    for(; i < count; i++){
+        block->Overflow32.Extents[i].Start = extents[i].Start;
+        block->Overflow32.Extents[i].Length = extents[i].Length;
+    }
+    block->Overflow32.Count = count;
+    block->Overflow32.Next = next;
+}
+
 // Format file system ----------------------------------------------------------
 
-bool FileSystem::format(Disk *disk) {
-    if(disk->mounted()){
+bool FileSystem::format(Disk *disk, bool lazyInodes, uint32_t version, const FormatOptions &options) {
+    if(disk->mounted() || version > INLINE_VERSION){
         // printf("disk is mounted, cannot be formated\n");
         return false;
     }
-    Block block = {0};
-    // Write superblock
-    block.Super.MagicNumber = FileSystem::MAGIC_NUMBER;
-    block.Super.Blocks = disk->size();
-    block.Super.InodeBlocks = (uint32_t)ceil((double)block.Super.Blocks * 0.1);
-    block.Super.Inodes = INODES_PER_BLOCK * block.Super.InodeBlocks;
-    disk->write(0, block.Data);
+    // Prepare superblock
+    SuperBlock super = SuperBlock();
+    super.MagicNumber = FileSystem::MAGIC_NUMBER;
+    super.BlockSize = Geometry::SIZE;
+    super.Blocks = disk->size();
+    if(super.Blocks > UINT32_MAX || inode_blocks(super.Blocks, version, options) > UINT32_MAX / (Geometry::SIZE / inode_size(version))){
+        //block and inode numbers no longer fit the 32-bit formats
+        if(version == POINTER_VERSION){
+            return false;
+        }
+        if(version == EXTENT_VERSION){
+            version = EXTENT64_VERSION;
+        }
+    }
+    super.Version = version;
+    super.InodeBlocks = inode_blocks(super.Blocks, version, options);
+    if((options.Inodes || options.BytesPerInode) && super.InodeBlocks + 1 >= super.Blocks){
+        //no room left for data
+        return false;
+    }
+    super.Inodes = Geometry::SIZE / inode_size(version) * super.InodeBlocks;
+    //the allocation bitmaps take the last blocks, if that leaves room for data
+    uint64_t bitmapBlocks = bitmap_blocks(super.Blocks, super.Inodes);
+    if(super.Blocks > super.InodeBlocks + 1 + bitmapBlocks){
+        super.Clean = 1;
+        super.BitmapStart = super.Blocks - bitmapBlocks;
+        super.BitmapBlocks = bitmapBlocks;
+    }
+    //the journal goes right before the bitmaps, so the data blocks still start after the inodes
+    uint64_t journalBlocks = journal_blocks(super.Blocks);
+    if(journalBlocks && super.Blocks > super.InodeBlocks + 1 + super.BitmapBlocks + journalBlocks){
+        super.JournalStart = super.Blocks - super.BitmapBlocks - journalBlocks;
+        super.JournalBlocks = journalBlocks;
+    }
+    if(options.ReservedBlocks){
+        //the reserve must leave data blocks to allocate
+        if(super.Blocks <= super.InodeBlocks + 1 + super.BitmapBlocks + super.JournalBlocks + options.ReservedBlocks){
+            return false;
+        }
+        super.ReservedBlocks = options.ReservedBlocks;
+    }
+    if(lazyInodes && super.InodeBlocks){
+        //no inode block is initialized yet, mount zeroes them in the background
+        super.InodeInitEnd = 1;
+    }
 
-    // Clear all other blocks
-    memset(block.Data, 0, Disk::BLOCK_SIZE);
-    uint32_t bnum = disk->size() - 1;
-    for(; bnum >= 1; bnum--){
-        disk->write(bnum, block.Data);
+    // Zero the image without writing it where possible; only the inode blocks must read as zeros
+    if(super.Blocks > super.InodeBlocks){
+        uint64_t dataBlocks = super.Blocks - super.InodeBlocks - 1;
+        if(super.InodeInitEnd){
+            disk->discard(super.InodeBlocks + 1, dataBlocks);
+        }
+        else if(!disk->discard(1, super.Blocks - 1)){
+            disk->zero(1, super.InodeBlocks);
+            disk->discard(super.InodeBlocks + 1, dataBlocks);
+        }
+    }
+
+    if(super.JournalBlocks){
+        Journal::format(disk, super.JournalStart, super.JournalBlocks);
+    }
+
+    // Bitmaps of the empty file system: only metadata blocks are used
+    if(super.BitmapBlocks){
+        Bitmap blocks(super.Blocks);
+        Bitmap inodes(super.Inodes);
+        uint64_t b = 0;
+        for(; b <= super.InodeBlocks; b++){
+            blocks.set(b);
+        }
+        for(b = super.JournalStart; b < super.JournalStart + super.JournalBlocks; b++){
+            blocks.set(b);
+        }
+        for(b = super.BitmapStart; b < super.Blocks; b++){
+            blocks.set(b);
+        }
+        char *bitmaps = (char *)malloc(super.BitmapBlocks * Disk::BLOCK_SIZE);
+        pack_bitmaps(blocks, inodes, bitmaps, super.BitmapBlocks * Disk::BLOCK_SIZE);
+        disk->write_blocks(super.BitmapStart, super.BitmapBlocks, bitmaps);
+        free(bitmaps);
     }
 
+    // Write superblock last, once the rest of the file system is in place
+    Block block;
+    store_superblock(super, &block);
+    disk->write(0, block.Data);
     return true;
 }
 
 // Mount file system -----------------------------------------------------------
 
 bool FileSystem::mount(Disk *disk) {
+    StatsTimer timer(Stats::MOUNT);
     if(disk == currMountedDisk){
         // printf("disk = %p, currMountedDisk = %p\n", disk, currMountedDisk);
         return false;
     }
     // Read superblock
-    Block superblock;
-    disk->read(0, superblock.Data);
-    if(superblock.Super.MagicNumber != MAGIC_NUMBER || superblock.Super.Blocks != disk->size() || superblock.Super.InodeBlocks != (uint32_t)ceil((double)superblock.Super.Blocks * 0.1) || superblock.Super.Inodes != superblock.Super.InodeBlocks * INODES_PER_BLOCK){
-        // printf("superblock.Super.MagicNumber = %u, superblock.Super.Blocks = %u, disk->size() = %lu, superblock.Super.InodeBlocks = %u, (uint32_t)ceil((double)superblock.Super.Blocks * 0.1) = %u, superblock.Super.Inodes = %u, superblock.Super.InodeBlocks * POINTERS_PER_BLOCK = %u\n", superblock.Super.MagicNumber, superblock.Super.Blocks, disk->size(), superblock.Super.InodeBlocks, (uint32_t)ceil((double)superblock.Super.Blocks * 0.1), superblock.Super.Inodes, superblock.Super.InodeBlocks * INODES_PER_BLOCK);
-        // printf("superblock.Super.MagicNumber != MAGIC_NUMBER: %d\n", superblock.Super.MagicNumber != MAGIC_NUMBER);
-        // printf("superblock.Super.Blocks != disk->size(): %d\n", superblock.Super.Blocks != disk->size());
-        // printf("superblock.Super.InodeBlocks != (uint32_t)ceil((double)superblock.Super.Blocks * 0.1): %d\n", superblock.Super.InodeBlocks != (uint32_t)ceil((double)superblock.Super.Blocks * 0.1));
-        // printf("superblock.Super.Inodes != superblock.Super.InodeBlocks * POINTERS_PER_BLOCK: %d\n", superblock.Super.Inodes != superblock.Super.InodeBlocks * POINTERS_PER_BLOCK);
+    Block block;
+    SuperBlock superblock;
+    disk->read(0, block.Data);
+    load_superblock(block, &superblock);
+    if(superblock.MagicNumber != MAGIC_NUMBER || superblock.Version > INLINE_VERSION || superblock.Blocks != disk->size()
+       || (superblock.BlockSize && superblock.BlockSize != Geometry::SIZE)
+       || superblock.InodeBlocks == 0 || superblock.InodeBlocks >= superblock.Blocks
+       || superblock.Inodes != superblock.InodeBlocks * (Geometry::SIZE / inode_size(superblock.Version))
+       || superblock.ReservedBlocks >= superblock.Blocks
+       || (superblock.BitmapBlocks && (superblock.BitmapStart <= superblock.InodeBlocks || superblock.BitmapStart + superblock.BitmapBlocks != superblock.Blocks
+           || superblock.BitmapBlocks != bitmap_blocks(superblock.Blocks, superblock.Inodes)))
+       || superblock.InodeInitEnd > superblock.InodeBlocks
+       || (superblock.JournalBlocks && (superblock.JournalBlocks < Journal::MIN_BLOCKS || superblock.JournalStart <= superblock.InodeBlocks
+           || superblock.JournalStart + superblock.JournalBlocks > (superblock.BitmapBlocks ? superblock.BitmapStart : superblock.Blocks)))){
         return false;
     }
 
     // Set device and mount
+    if(currMountedDisk){
+        unmount();
+    }
     currMountedDisk = disk;
     disk->mount();
+    //blocks held for the journal are never evicted, so a journal needs room for them and the rest
+    size_t capacity = cacheBlocks;
+    if(superblock.JournalBlocks && capacity < MIN_JOURNAL_CACHE){
+        capacity = MIN_JOURNAL_CACHE;
+    }
+    cache = new BlockCache(disk, capacity);
 
-    // Copy metadata
+    // Copy metadata and the geometry derived from it
+    meta = superblock;
+    inodeSize = inode_size(meta.Version);
+    inodesPerBlock = Geometry::SIZE / inodeSize;
+    dataStart = meta.InodeBlocks + 1;
+    allocHint = dataStart;
+    reservedBlocks = 0;
+    allocStats = AllocatorStats();
+
+    //put the transactions committed before a crash in place before anything reads the metadata
+    if(meta.JournalBlocks){
+        journal = new Journal(disk, cache, meta.JournalStart, meta.JournalBlocks);
+        ssize_t replayed = journal->replay();
+        if(replayed < 0){
+            delete journal;
+            journal = NULL;
+            delete cache;
+            cache = NULL;
+            disk->unmount();
+            currMountedDisk = NULL;
+            return false;
+        }
+        if(replayed > 0){
+            fprintf(stderr, "replayed %ld journal transactions\n", replayed);
+        }
+        //wake the committer before a transaction outgrows the cache or the journal
+        commitThreshold = std::min(cache->capacity() / 4, journal->capacity() / 2);
+    }
 
     // Allocate free block bitmap and inode table
-    free(free_block_map);
     free(inode_table);
-    free_block_map = (uint32_t *)malloc(sizeof(int) * superblock.Super.Blocks);
-    inode_table = (Inode *)malloc(sizeof(Inode) * superblock.Super.Inodes);
-    memset((void *)free_block_map, 0, sizeof(int) * superblock.Super.Blocks);
-    memset((void *)inode_table, 0, sizeof(Inode) * superblock.Super.Inodes);
-    free_block_map[0] = 1;
-    uint32_t bnum = 1;
-    uint32_t inum = 0;
-    Block inodeBlock;
-    for(; bnum <= superblock.Super.InodeBlocks; bnum++){
-        free_block_map[bnum] = 1;
-        uint32_t i = 0;
-        disk->read(bnum, inodeBlock.Data);
-        for(; i < INODES_PER_BLOCK; i++, inum++){
-            if(inodeBlock.Inodes[i].Valid && inodeBlock.Inodes[i].Size > 0){
-                // printf("Inode %u is valid\n", inum);
-                Inode inode = inodeBlock.Inodes[i];
-                inode_table[inum] = inode;
-                //direct pointers
-                set_free_block_map(inode.Direct, POINTERS_PER_INODE, 1);
-                //indirect pointers
-                set_free_block_map(&inode.Indirect, 1, 1);
-                if(inode.Indirect){
-                    Block pointerBlock;
-                    disk->read(inode.Indirect, pointerBlock.Data);
-                    set_free_block_map(pointerBlock.Pointers, POINTERS_PER_BLOCK, 1);
-                }
-            }
+    free_block_map.reset(meta.Blocks);
+    free_inode_map.reset(meta.Inodes);
+    inodeHint = 0;
+    inode_table = (Inode *)malloc(sizeof(Inode) * meta.Inodes);
+    memset((void *)inode_table, 0, sizeof(Inode) * meta.Inodes);
+
+    load_inode_table();
+
+    //after a clean unmount the saved bitmaps are exact, so there is nothing to scan
+    if(meta.BitmapBlocks && meta.Clean){
+        load_bitmaps();
+    }
+    else{
+        uint64_t bnum = 0;
+        for(; bnum <= meta.InodeBlocks; bnum++){
+            free_block_map.set(bnum);
+        }
+        for(bnum = meta.JournalStart; bnum < meta.JournalStart + meta.JournalBlocks; bnum++){
+            free_block_map.set(bnum);
         }
+        for(bnum = meta.BitmapStart; meta.BitmapBlocks && bnum < meta.Blocks; bnum++){
+            free_block_map.set(bnum);
+        }
+        scan_inodes();
     }
 
+    //the reserve is held back from allocation like the blocks promised to delayed writes
+    size_t freeBlocks = free_block_map.size() - free_block_map.count();
+    reservedBlocks = meta.ReservedBlocks < freeBlocks ? meta.ReservedBlocks : freeBlocks;
+
+    //the saved bitmaps go stale with the first change, so they only count again after unmount
+    if(meta.Clean){
+        meta.Clean = 0;
+        save_superblock();
+    }
+    if(meta.InodeInitEnd){
+        stopInitializer = false;
+        inode_initializer = std::thread(&FileSystem::initialize_inodes, this);
+    }
+    if(journal){
+        stopCommitter = false;
+        journal_committer = std::thread(&FileSystem::run_committer, this);
+    }
     return true;
 }
 
-//set numbers pointed by valid pointers(!=0) from @pointer to @pointer + @length to @value
-void FileSystem::set_free_block_map(uint32_t *pointer, uint32_t length, uint32_t value){
-    uint32_t i = 0;
-    for(; i < length; i++){
-        if(pointer[i]){//!=0
-            // printf("pointer  = %u\n", pointer[i]);
-            free_block_map[pointer[i]] = value;
+//read the whole inode region into the inode table with a few large requests. inodes of the
+//32-bit formats are read into a separate buffer and widened into the table
+void FileSystem::load_inode_table(){
+    //inode blocks past the high-water mark hold no inodes and may not even be zeroed yet
+    uint64_t blocks = meta.InodeInitEnd ? meta.InodeInitEnd - 1 : meta.InodeBlocks;
+    char *raw = (char *)inode_table;
+    if(inodeSize != sizeof(Inode)){
+        raw = (char *)malloc(blocks * Disk::BLOCK_SIZE);
+    }
+    uint64_t b = 0;
+    for(; b < blocks; b += INODE_TABLE_CHUNK){
+        uint64_t count = blocks - b < INODE_TABLE_CHUNK ? blocks - b : INODE_TABLE_CHUNK;
+        cache->read_blocks(1 + b, count, raw + b * Disk::BLOCK_SIZE);
+    }
+    cache->wait();
+
+    //keep inode blocks around for save_inode while the cache has room
+    for(b = 0; b < blocks; b++){
+        cache->insert(1 + b, raw + b * Disk::BLOCK_SIZE);
+    }
+    if(raw != (char *)inode_table){
+        size_t inum = 0;
+        for(; inum < blocks * inodesPerBlock; inum++){
+            load_inode(raw + inum * inodeSize, meta.Version, &inode_table[inum]);
+        }
+        free(raw);
+    }
+}
+
+//mark valid inodes and every block they point to as used. the inode blocks are split between
+//worker threads, each collecting used blocks in its own bitmap, merged once they are all done
+void FileSystem::scan_inodes(){
+    size_t workers = std::thread::hardware_concurrency();
+    if(workers > meta.InodeBlocks / MOUNT_SCAN_BLOCKS){
+        workers = meta.InodeBlocks / MOUNT_SCAN_BLOCKS;
+    }
+    if(workers <= 1){
+        scan_inode_range(0, meta.Inodes, &free_block_map);
+    }
+    else{
+        Bitmap *used = new Bitmap[workers];
+        std::vector<std::thread> threads;
+        size_t w = 0;
+        for(; w < workers; w++){
+            size_t from = meta.InodeBlocks * w / workers * inodesPerBlock;
+            size_t to = meta.InodeBlocks * (w + 1) / workers * inodesPerBlock;
+            used[w].reset(meta.Blocks);
+            threads.push_back(std::thread(&FileSystem::scan_inode_range, this, from, to, &used[w]));
+        }
+        for(w = 0; w < workers; w++){
+            threads[w].join();
+            free_block_map.merge(used[w]);
+        }
+        delete [] used;
+    }
+
+    size_t inum = 0;
+    for(; inum < meta.Inodes; inum++){
+        if(inode_table[inum].Valid){
+            free_inode_map.set(inum);
+        }
+    }
+}
+
+//mark the blocks of valid inodes in [@from, @to) in @used, reading map blocks straight from disk
+void FileSystem::scan_inode_range(size_t from, size_t to, Bitmap *used){
+    std::vector<FileExtent> extents;
+    std::vector<uint64_t> mapBlocks;
+    size_t inum = from;
+    for(; inum < to; inum++){
+        const Inode &inode = inode_table[inum];
+        if(!inode.Valid){
+            continue;
+        }
+        load_block_map(&inode, extents, mapBlocks, true);
+        mark_used(used, extents, mapBlocks);
+    }
+}
+
+//set the bits of every block in @extents and @mapBlocks
+void FileSystem::mark_used(Bitmap *used, const std::vector<FileExtent> &extents, const std::vector<uint64_t> &mapBlocks){
+    size_t i = 0;
+    for(; i < extents.size(); i++){
+        uint64_t b = extents[i].Start;
+        for(; b < extents[i].Start + extents[i].Length; b++){
+            used->set(b);
+        }
+    }
+    for(i = 0; i < mapBlocks.size(); i++){
+        used->set(mapBlocks[i]);
+    }
+}
+
+//clear the bits of every block in @extents and @mapBlocks and return how many there are
+size_t FileSystem::mark_free(Bitmap *used, const std::vector<FileExtent> &extents, const std::vector<uint64_t> &mapBlocks){
+    size_t count = mapBlocks.size();
+    size_t i = 0;
+    for(; i < extents.size(); i++){
+        uint64_t b = extents[i].Start;
+        for(; b < extents[i].Start + extents[i].Length; b++){
+            used->clear(b);
+        }
+        count += extents[i].Length;
+    }
+    for(i = 0; i < mapBlocks.size(); i++){
+        used->clear(mapBlocks[i]);
+    }
+    return count;
+}
+
+//save all state and release the mounted disk, marking the bitmaps clean once everything else is on disk
+bool FileSystem::unmount(){
+    if(!pre_requisite()){
+        return false;
+    }
+    if(inode_initializer.joinable()){
+        {
+            std::lock_guard<std::mutex> lock(table_lock);
+            stopInitializer = true;
+        }
+        inode_initializer.join();
+    }
+    if(journal_committer.joinable()){
+        {
+            std::lock_guard<std::mutex> lock(committer_lock);
+            stopCommitter = true;
+        }
+        commit_wakeup.notify_one();
+        journal_committer.join();
+    }
+    release_handles();
+    sync();
+    if(journal){
+        //everything is in place after sync, so the next mount has nothing to replay
+        journal->checkpoint();
+    }
+    if(meta.BitmapBlocks){
+        meta.Clean = 1;
+        save_superblock();
+        currMountedDisk->sync();
+    }
+
+    fprintf(stderr, "%lu cache hits\n", cache->hits());
+    fprintf(stderr, "%lu cache misses\n", cache->misses());
+    fprintf(stderr, "%lu cache evictions\n", cache->evictions());
+    fprintf(stderr, "%lu readahead blocks\n", cache->prefetches());
+    fprintf(stderr, "%lu readahead hits\n", cache->readahead_hits());
+    fprintf(stderr, "%lu readahead wasted\n", cache->readahead_wasted());
+    if(journal){
+        fprintf(stderr, "%lu journal commits\n", journal->commits());
+        fprintf(stderr, "%lu journal blocks logged\n", journal->logged());
+        fprintf(stderr, "%lu journal checkpoints\n", journal->checkpoints());
+        fprintf(stderr, "%lu cache stalls\n", cache->stalls());
+        delete journal;
+        journal = NULL;
+    }
+    delete cache;
+    cache = NULL;
+    currMountedDisk->unmount();
+    currMountedDisk = NULL;
+    free(inode_table);
+    inode_table = NULL;
+    free_block_map.reset(0);
+    preallocWindows.clear();
+    free_inode_map.reset(0);
+    meta = SuperBlock();
+    return true;
+}
+
+//write the in-memory superblock to block 0
+void FileSystem::save_superblock(){
+    Block superblock;
+    store_superblock(meta, &superblock);
+    currMountedDisk->write(0, superblock.Data);
+}
+
+//background initializer: zero the remaining inode blocks a chunk at a time
+void FileSystem::initialize_inodes(){
+    while(true){
+        {
+            std::lock_guard<std::mutex> lock(table_lock);
+            if(stopInitializer || meta.InodeInitEnd == 0){
+                return;
+            }
+            init_inode_blocks(meta.InodeInitEnd + INODE_INIT_CHUNK);
         }
+        std::this_thread::yield();
+    }
+}
+
+//zero the inode blocks from the high-water mark up to @end and move the mark past them.
+//the mark is saved before any inode in those blocks can be created. caller holds table_lock
+void FileSystem::init_inode_blocks(uint64_t end){
+    if(meta.InodeInitEnd == 0 || end <= meta.InodeInitEnd){
+        return;
+    }
+    if(end > meta.InodeBlocks){
+        end = meta.InodeBlocks + 1;
+    }
+    currMountedDisk->zero(meta.InodeInitEnd, end - meta.InodeInitEnd);
+    meta.InodeInitEnd = end > meta.InodeBlocks ? 0 : end;
+    save_superblock();
+}
+
+//number of journal blocks format reserves on a disk of @blocks blocks (0 if it is too small for one)
+uint64_t FileSystem::journal_blocks(uint64_t blocks){
+    uint64_t journalBlocks = blocks / JOURNAL_RATIO;
+    if(journalBlocks < Journal::MIN_BLOCKS){
+        return 0;
+    }
+    return journalBlocks < MAX_JOURNAL_BLOCKS ? journalBlocks : MAX_JOURNAL_BLOCKS;
+}
+
+//number of blocks holding the block bitmap followed by the inode bitmap, each padded to 64-bit words
+uint64_t FileSystem::bitmap_blocks(uint64_t blocks, uint64_t inodes){
+    uint64_t words = (blocks + 63) / 64 + (inodes + 63) / 64;
+    return (words * sizeof(uint64_t) + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+}
+
+//lay out @blocks and @inodes the way they are stored in the bitmap region
+void FileSystem::pack_bitmaps(const Bitmap &blocks, const Bitmap &inodes, char *buffer, size_t size){
+    memset(buffer, 0, size);
+    blocks.save((uint64_t *)buffer);
+    inodes.save((uint64_t *)buffer + blocks.words());
+}
+
+//read the bitmap region into the free block and free inode maps
+void FileSystem::load_bitmaps(){
+    size_t size = meta.BitmapBlocks * Disk::BLOCK_SIZE;
+    char *buffer = (char *)malloc(size);
+    currMountedDisk->read_blocks(meta.BitmapStart, meta.BitmapBlocks, buffer);
+    free_block_map.load((const uint64_t *)buffer);
+    free_inode_map.load((const uint64_t *)buffer + free_block_map.words());
+    free(buffer);
+}
+
+//write the free block and free inode maps to the bitmap region
+void FileSystem::save_bitmaps(){
+    size_t size = meta.BitmapBlocks * Disk::BLOCK_SIZE;
+    char *buffer = (char *)malloc(size);
+    {
+        std::lock_guard<std::mutex> tableLock(table_lock);
+        std::lock_guard<std::mutex> allocLock(alloc_lock);
+        pack_bitmaps(free_block_map, free_inode_map, buffer, size);
+    }
+    currMountedDisk->write_blocks(meta.BitmapStart, meta.BitmapBlocks, buffer);
+    free(buffer);
+}
+
+//return every block in @extents and @mapBlocks to the free block map. with a journal they are held
+//back until the change that frees them is committed: until then a crash brings back the old metadata,
+//which still points at them
+void FileSystem::release_blocks(const std::vector<FileExtent> &extents, const std::vector<uint64_t> &mapBlocks){
+    std::lock_guard<std::mutex> lock(alloc_lock);
+    if(journal){
+        freedExtents.insert(freedExtents.end(), extents.begin(), extents.end());
+        freedMapBlocks.insert(freedMapBlocks.end(), mapBlocks.begin(), mapBlocks.end());
+        return;
     }
+    allocStats.Freed += mark_free(&free_block_map, extents, mapBlocks);
 }
 
 // Create inode ----------------------------------------------------------------
 
 ssize_t FileSystem::create() {
+    StatsTimer timer(Stats::CREATE);
     if(!pre_requisite()){
         // printf("there is no mounted disk\n");
         return -1;
     }
-    // Locate free inode in inode table
-    int inum = 0;
-    int inodes = (int)ceil((double)currMountedDisk->size() * 0.1) * INODES_PER_BLOCK;//length of inode table
-    // printf("length of inode table: %d\n", inodes);
-    Inode inode;
-    load_inode(0, &inode);//no use, just for passing the test
-    for(; inum < inodes; inum++){
-        if(!(inode_table[inum].Valid)){
-            // printf("find inode %d!\n", inum);
-            break;
-        }
+    // Locate free inode in free inode map, inodeHint is never above the lowest free inode
+    std::lock_guard<std::mutex> lock(table_lock);
+    if(free_inode_map.count() == free_inode_map.size()){
+        return -1;
     }
-    // Record inode if found
-    if(inum < inodes){
-        memset(&(inode_table[inum]), 0, sizeof(Inode));
-        inode_table[inum].Valid = 1;
-        if(save_inode(inum, &(inode_table[inum]))){
-            return inum;
-        }
+    ssize_t inum = free_inode_map.find_clear(inodeHint, meta.Inodes);
+    if(inum < 0){
+        return -1;
+    }
+
+    // Make sure the inode block has been zeroed before using it
+    init_inode_blocks(1 + inum / inodesPerBlock + 1);
+
+    // Record inode, the inline data and the inode itself in the same transaction
+    MetadataUpdate update(this, 1);
+    free_inode_map.set(inum);
+    inodeHint = inum + 1;
+    memset(&(inode_table[inum]), 0, sizeof(Inode));
+    inode_table[inum].Valid = 1;
+    if(meta.Version == INLINE_VERSION){
+        //a removed file may have left its data behind
+        char zeros[INLINE_DATA] = {0};
+        inline_range(inum, 0, INLINE_DATA, zeros, true);
+    }
+    if(save_inode(inum, &(inode_table[inum]))){
+        return inum;
     }
     return -1;
 }
@@ -193,46 +843,47 @@ ssize_t FileSystem::create() {
 // Remove inode ----------------------------------------------------------------
 
 bool FileSystem::remove(size_t inumber) {
+    StatsTimer timer(Stats::REMOVE);
     if(!pre_requisite() || out_of_bound_inumber(inumber)){
         return false;
     }
     // Load inode information
+    std::lock_guard<std::mutex> lock(table_lock);
     Inode removeInode = inode_table[inumber];
-    load_inode(inumber, &removeInode);//no use, just for passing the test
-    if(!removeInode.Valid){
+    if(!removeInode.Valid || open_inodes.count(inumber)){
+        //files are not removed while they are open
         return false;
     }
 
-    // Free direct blocks
-    set_free_block_map(removeInode.Direct, POINTERS_PER_INODE, 0);
-
-    // Free indirect blocks
-    set_free_block_map(&removeInode.Indirect, 1, 0);
-    if(removeInode.Indirect){
-        Block pointerBlock;
-        currMountedDisk->read(removeInode.Indirect, pointerBlock.Data);
-        set_free_block_map(pointerBlock.Pointers, POINTERS_PER_BLOCK, 0);
-    }
+    // Free data blocks and the blocks holding the block map, in the transaction that clears the inode
+    MetadataUpdate update(this, 1);
+    std::vector<FileExtent> extents;
+    std::vector<uint64_t> mapBlocks;
+    load_block_map(&removeInode, extents, mapBlocks, false);
+    release_blocks(extents, mapBlocks);
 
     // Clear inode in inode table
     memset(&(inode_table[inumber]), 0, sizeof(Inode));
+    free_inode_map.clear(inumber);
+    inodeHint = std::min(inodeHint, inumber);
     return save_inode(inumber, &(inode_table[inumber]));
 }
 
 // Inode stat ------------------------------------------------------------------
 
 ssize_t FileSystem::stat(size_t inumber) {  
+    StatsTimer timer(Stats::STAT);
     if(!pre_requisite() || out_of_bound_inumber(inumber)){
         return -1;
     }
-    // Load inode information
-    Inode inode = inode_table[inumber];
-    load_inode(inumber, &inode);//no use, just for passing the test
-    if(!inode.Valid){
+    // Load inode information, the size of an open inode may be changing under its writer
+    std::lock_guard<std::mutex> lock(table_lock);
+    Inode *inode = &inode_table[inumber];
+    if(!inode->Valid){
         return -1;
     }
     else{
-        return inode.Size;
+        return __atomic_load_n(&inode->Size, __ATOMIC_RELAXED);
     }
     return 0;
 }
@@ -240,284 +891,1258 @@ ssize_t FileSystem::stat(size_t inumber) {
 // Read from inode -------------------------------------------------------------
 
 ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset) {
-    if(!pre_requisite() || out_of_bound_inumber(inumber) || length < 0){
+    StatsTimer timer(Stats::READ);
+    if(!pre_requisite() || out_of_bound_inumber(inumber)){
         return -1;
     }
     // Load inode information
-    Inode readInode;
-    load_inode(inumber, &readInode);
-    if(!readInode.Valid || offset >= readInode.Size){
-        // printf("valid: %u, offset: %lu, size: %u\n", readInode.Valid, offset, readInode.Size);
+    OpenInode *node = get_inode(inumber);
+    if(node == NULL){
         return -1;
     }
+    ssize_t readBytes = -1;
+    {
+        ReadGuard guard(node->Lock);
+        Inode *readInode = &inode_table[inumber];
+        if(offset < readInode->Size){
+            // Adjust length
+            if(length + offset > readInode->Size){
+                length = readInode->Size - offset;
+            }
 
-    // Adjust length
-    if(length + offset > readInode.Size){
-        length = readInode.Size - offset;
-    }
-    // printf("after adjustment, length = %lu\n", length);
-    if(length == 0){
-        // printf("length == %lu, return\n", length);
-        return length;
-    }
-
-    // Read block and copy to data
-    size_t readBytes = inner_read(readInode.Direct, POINTERS_PER_INODE, length, data, offset);
-    // printf("after read direct blocks, readBytes = %lu, disk reads = %lu\n", readBytes, currMountedDisk->getReads());
-    if(readBytes == length){
-        // printf("just read direct blocks\n");
-        return length;
-    }
-    load_inode(inumber, &readInode);//no use, just for passing the test
-    if(readInode.Indirect == 0){
-        return -1;
-    }
-    Block pointersBlock;
-    currMountedDisk->read(readInode.Indirect, pointersBlock.Data);
-    if(offset <= POINTERS_PER_INODE * Disk::BLOCK_SIZE){
-        offset = 0;
-    }
-    else{
-        offset -= POINTERS_PER_INODE * Disk::BLOCK_SIZE;
-    }
-    // printf("offset = %lu\n", offset);
-    readBytes += inner_read(pointersBlock.Pointers, POINTERS_PER_BLOCK, length - readBytes, data + readBytes, offset);
-    // printf("after read indirect blocks, readBytes = %lu disk reads = %lu\n", readBytes, currMountedDisk->getReads());
-    if(readBytes < length){
-        return -1;//should never happen
+            // Read blocks and copy to data
+            readBytes = length ? inner_read(node, data, length, offset) : 0;
+            Stats::transferred(Stats::READ, readBytes);
+        }
     }
-    // printf("also read indirect blocks\n");
-    return length;
+    put_inode(node);
+    return readBytes;
 }
 
 /**
  * help function for read
- * read at most length bytes from @bnumNumber blocks pointed by @bnumPointer to @data, 
- * starting at @offset bytes from first block pointed by @bnumPointer. 
- * return value <= @length
+ * read @length bytes starting at byte @offset of the file described by @node to @data.
+ * caller ensures that @offset + @length is not beyond the size of the file.
+ * unallocated blocks read as zeros.
  **/
-size_t FileSystem::inner_read(uint32_t *bnumPointer, uint32_t bnumNumber, size_t length, char *data, size_t offset){
+size_t FileSystem::inner_read(OpenInode *node, char *data, size_t length, size_t offset){
+    if(is_inline(node)){
+        inline_range(node->Inumber, offset, length, data, false);
+        return length;
+    }
     size_t readBytes = 0;
-    uint32_t d = 0;
-    for(; d < bnumNumber; d++){
-        if(bnumPointer[d]){
-            //bnumPointer[0:d-1] is not zero
-            uint32_t bnum = bnumPointer[d];
-            if(offset >= (d + 1) * Disk::BLOCK_SIZE){
-                continue;
-            }
-            if(offset <= d * Disk::BLOCK_SIZE && length - readBytes > Disk::BLOCK_SIZE){
-                //read whole block
-                // printf("read whole block %u\n", bnum);
-                currMountedDisk->read(bnum, data + readBytes);
-                readBytes += Disk::BLOCK_SIZE;
-            }
-            else if(offset <= d * Disk::BLOCK_SIZE){
-                //read part of block and then return
-                // printf("read part of block %u and then return\n", bnum);
-                Block tempBlock;
-                currMountedDisk->read(bnum, tempBlock.Data);
-                memcpy(data + readBytes, tempBlock.Data, length - readBytes);
-                return length;
+    while(readBytes < length){
+        size_t b = Geometry::block_of(offset + readBytes);//logical block
+        size_t start = Geometry::offset_in(offset + readBytes);
+        size_t chunk = Geometry::SIZE - start;
+        if(chunk > length - readBytes){
+            chunk = length - readBytes;
+        }
+        size_t run;
+        uint64_t bnum = lookup(node, b, &run);
+        if(bnum == 0){
+            //a block written but not allocated yet is read from its buffer
+            std::map<uint64_t, char *>::iterator it = node->Delayed.find(b);
+            if(it != node->Delayed.end()){
+                memcpy(data + readBytes, it->second + start, chunk);
             }
             else{
-                //first block to read
-                // printf("first block to read: block %u and then return\n", bnum);
-                Block tempBlock;
-                currMountedDisk->read(bnum, tempBlock.Data);
-                if(offset + length <= (d + 1) * Disk::BLOCK_SIZE){
-                    //last read
-                    memcpy(data + readBytes, tempBlock.Data + (offset % Disk::BLOCK_SIZE), length);
-                    return length;
-                }
-                else{
-                    // printf("left part of block %u\n", bnum);
-                    //read from tempBlock.Data + (offset % Disk::BLOCK_SIZE) to tempBlock.Data + Disk::BLOCK_SIZE
-                    memcpy(data + readBytes, tempBlock.Data + (offset % Disk::BLOCK_SIZE), (Disk::BLOCK_SIZE - (offset % Disk::BLOCK_SIZE)));
-                    readBytes += Disk::BLOCK_SIZE - (offset % Disk::BLOCK_SIZE);
-                }
+                memset(data + readBytes, 0, chunk);
+            }
+        }
+        else if(chunk == Geometry::SIZE){
+            //queue whole blocks, one request per extent
+            size_t count = Geometry::block_of(length - readBytes);
+            if(run > count){
+                run = count;
             }
+            cache->read_blocks(bnum, run, data + readBytes);
+            chunk = Geometry::bytes_of(run);
         }
+        else{
+            //read part of block, copied straight out of the cache or the mapping
+            cache->read_range(bnum, start, chunk, data + readBytes);
+        }
+        readBytes += chunk;
     }
+    //read ahead while the runs are in flight, then wait for everything queued
+    readahead(node, offset, length);
+    cache->wait();
     return readBytes;
 }
 
+/**
+ * help function for inner_read
+ * a read starting where the previous read of @node ended is sequential: the window starts at twice
+ * the request and doubles with every sequential read up to readaheadBlocks, and the blocks past
+ * the request that were not read ahead yet are prefetched into the cache. any other read resets it.
+ * caller holds @node->Lock shared.
+ **/
+void FileSystem::readahead(OpenInode *node, size_t offset, size_t length){
+    //a mapped disk is read in place (and the page cache reads ahead for an image file)
+    if(readaheadBlocks == 0 || currMountedDisk->mapped()){
+        return;
+    }
+    size_t first, last;
+    {
+        std::lock_guard<std::mutex> lock(node->ReadaheadLock);
+        bool sequential = offset == node->NextOffset;
+        node->NextOffset = offset + length;
+        if(!sequential){
+            node->Window = 0;
+            node->ReadaheadEnd = 0;
+            return;
+        }
+        size_t end = Geometry::blocks_for(offset + length);
+        node->Window = node->Window ? node->Window * 2 : 2 * (end - Geometry::block_of(offset));
+        if(node->Window > readaheadBlocks){
+            node->Window = readaheadBlocks;
+        }
+        size_t fileBlocks = Geometry::blocks_for(inode_table[node->Inumber].Size);
+        first = end > node->ReadaheadEnd ? end : node->ReadaheadEnd;
+        last = end + node->Window < fileBlocks ? end + node->Window : fileBlocks;
+        if(first >= last){
+            return;
+        }
+        node->ReadaheadEnd = last;
+    }
+    for(size_t b = first; b < last; ){
+        size_t run;
+        uint64_t bnum = lookup(node, b, &run);
+        if(run > last - b){
+            run = last - b;
+        }
+        if(bnum != 0){
+            cache->prefetch(bnum, run);
+        }
+        b += run;
+    }
+}
+
+//return the physical block behind logical block @b of @node, 0 if it lies in a hole. *@run is set to
+//the number of blocks from @b to the end of its extent, or to the end of the hole (SIZE_MAX past the last extent)
+uint64_t FileSystem::lookup(OpenInode *node, size_t b, size_t *run){
+    //binary search for the first extent starting after @b, the one before it may hold @b
+    size_t lo = 0;
+    size_t hi = node->Extents.size();
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(node->Extents[mid].Logical <= b){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    if(lo > 0){
+        const FileExtent &extent = node->Extents[lo - 1];
+        if(b < (size_t)extent.Logical + extent.Length){
+            *run = extent.Logical + extent.Length - b;
+            return extent.Start + (b - extent.Logical);
+        }
+    }
+    *run = lo < node->Extents.size() ? node->Extents[lo].Logical - b : SIZE_MAX;
+    return 0;
+}
 
 // Write to inode --------------------------------------------------------------
 
 ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset) {
-    if(!pre_requisite() || out_of_bound_inumber(inumber) || length < 0){
+    StatsTimer timer(Stats::WRITE);
+    if(!pre_requisite() || out_of_bound_inumber(inumber)){
         return -1;
     }
     if(length == 0){
         return length;
     }
     // Load inode
-    Inode writeInode;
-    load_inode(inumber, &writeInode);
-    if(!writeInode.Valid || offset > writeInode.Size){
-        // if offset > readInode.Size then there will be empty bytes in the inode, content of the inode will be not continous
-        // printf("valid: %u, offset: %lu, size: %u\n", writeInode.Valid, offset, writeInode.Size);
+    OpenInode *node = get_inode(inumber);
+    if(node == NULL){
         return -1;
     }
-    
-    // Write block and copy to data
-    size_t writtenBytes = inner_write(writeInode.Direct,  POINTERS_PER_INODE, length, data, offset);
-    if(writtenBytes == length){
-        // printf("just read direct blocks\n");
-        writeInode.Size = offset + length;
-        inode_table[inumber] = writeInode;
-        save_inode(inumber, &writeInode);
-        return length;
-    }
-    Block pointersBlock;
-    if(writeInode.Indirect == 0){
-        ssize_t pointerBnum = allocate_free_block();
-        // printf("allocate_free_block return %ld\n", pointerBnum);
-        if(pointerBnum < 0){
-            writeInode.Size = offset + writtenBytes;
-            inode_table[inumber] = writeInode;
-            save_inode(inumber, &writeInode);
-            return writtenBytes;
-        }
-        writeInode.Indirect = pointerBnum;
-        memset(pointersBlock.Data, 0, Disk::BLOCK_SIZE);
+    ssize_t writtenBytes = -1;
+    {
+        WriteGuard guard(node->Lock);
+        // Write block and copy from data, the blocks skipped past the end of the file are left as a hole
+        writtenBytes = inner_write(node, data, length, offset);
+        Stats::transferred(Stats::WRITE, writtenBytes);
     }
-    else{
-        // printf("1. read blocknum %u\n", writeInode.Indirect);
-        currMountedDisk->read(writeInode.Indirect, pointersBlock.Data);
-    }
-    // printf("after read pointersBlock\n");
-    size_t newOffset = 0;
-    if(offset > POINTERS_PER_INODE * Disk::BLOCK_SIZE){
-        newOffset = offset - POINTERS_PER_INODE * Disk::BLOCK_SIZE;
-    }
-    // printf("newOffset = %lu\n", newOffset);
-    writtenBytes += inner_write(pointersBlock.Pointers, POINTERS_PER_BLOCK, length - writtenBytes, data + writtenBytes, newOffset);
-    // printf("after write indirect blocks, writtenBytes = %lu disk reads = %lu\n", writtenBytes, currMountedDisk->getReads());
-    // printf("also write indirect blocks\n");
-    writeInode.Size = offset + writtenBytes;
-    inode_table[inumber] = writeInode;
-    save_inode(inumber, &writeInode);
-    // printf("1. write blocknum %u\n", writeInode.Indirect);
-    currMountedDisk->write(writeInode.Indirect, pointersBlock.Data);
+    put_inode(node);
     return writtenBytes;
 }
 
-//
-size_t FileSystem::inner_write(uint32_t *bnumPointer, uint32_t bnumNumber, size_t length, char *data, size_t offset){
+/**
+ * help function for write
+ * write @length bytes from @data to the file described by @node, starting at byte @offset.
+ * blocks already on disk are written through the cache; blocks not allocated yet are buffered in
+ * @node->Delayed, with a free block reserved for each, and only allocated by flush_delayed(), at the
+ * latest when the inode is put or synced. the block map and size are only updated in memory.
+ * return value <= @length, less if the disk is full or the file reaches its maximum size
+ **/
+size_t FileSystem::inner_write(OpenInode *node, char *data, size_t length, size_t offset){
+    Inode *inode = &inode_table[node->Inumber];
     size_t writtenBytes = 0;
-    uint32_t d = 0;
-    for(; d < bnumNumber; d++){
-        if(offset >= (d + 1) * Disk::BLOCK_SIZE){
-            continue;
+    if(is_inline(node)){
+        if(offset + length <= INLINE_DATA){
+            //inline data is metadata: it is pinned in its inode block like the inode
+            MetadataUpdate update(this, 1);
+            inline_range(node->Inumber, offset, length, data, true);
+            writtenBytes = length;
         }
-        //caller ensures that bnumPointer[b] != 0 if d * BLOCK_SIZE < offset < (d+1) * BLOCK_SIZE
-        Block block;
-        if(bnumPointer[d]){
-            // printf("2. read blocknum %u\n", bnumPointer[d]);
-            currMountedDisk->read(bnumPointer[d], block.Data);
+        else if(!move_inline(node)){
+            return 0;
         }
-        else{
-            ssize_t newBnum = allocate_free_block();
-            // printf("inner_write, allocate_free_block return %ld\n", newBnum);
-            if(newBnum < 0){
-                //no free block to write
-                return writtenBytes;
-            }
-            bnumPointer[d] = newBnum;
-            // printf("3. read blocknum %u\n", bnumPointer[d]);
-            currMountedDisk->read(newBnum, block.Data);
-        }
-        if(offset <= d * Disk::BLOCK_SIZE && length - writtenBytes > Disk::BLOCK_SIZE){
-            //write whole block
-            memcpy(block.Data, data + writtenBytes, Disk::BLOCK_SIZE);
-            // printf("2. write blocknum %u\n", bnumPointer[d]);
-            currMountedDisk->write(bnumPointer[d], block.Data);
-            writtenBytes += Disk::BLOCK_SIZE;
-        }
-        else if(offset <= d * Disk::BLOCK_SIZE){
-            //write part of block and then return
-            // printf("write left part of block %u and then return\n", bnum);
-            memcpy(block.Data, data + writtenBytes, length - writtenBytes);
-            // printf("3. write blocknum %u\n", bnumPointer[d]);
-            currMountedDisk->write(bnumPointer[d], block.Data);
-            return length;
+    }
+    while(writtenBytes < length){
+        size_t b = Geometry::block_of(offset + writtenBytes);//logical block
+        size_t start = Geometry::offset_in(offset + writtenBytes);
+        size_t chunk = Geometry::SIZE - start;
+        if(chunk > length - writtenBytes){
+            chunk = length - writtenBytes;
         }
-        else{
-            //first block to write
-            // printf("first block to read: block %u and then return\n", bnum);
-            if(offset + length <= (d + 1) * Disk::BLOCK_SIZE){
-                //last read
-                memcpy(block.Data + (offset % Disk::BLOCK_SIZE), data + writtenBytes, length);
-                // printf("4. write blocknum %u\n", bnumPointer[d]);
-                currMountedDisk->write(bnumPointer[d], block.Data);
-                return length;
+
+        size_t run;
+        uint64_t bnum = lookup(node, b, &run);
+        if(bnum == 0){
+            if(!delay_block(node, b, start, chunk, data + writtenBytes)){
+                //no free block to reserve or file is as large as it can be
+                break;
             }
-            else{
-                // printf("right part of block %u\n", bnum);
-                memcpy(block.Data + (offset % Disk::BLOCK_SIZE), data + writtenBytes, (Disk::BLOCK_SIZE - (offset % Disk::BLOCK_SIZE)));
-                // printf("5. write blocknum %u\n", bnumPointer[d]);
-                currMountedDisk->write(bnumPointer[d], block.Data);
-                writtenBytes += Disk::BLOCK_SIZE - (offset % Disk::BLOCK_SIZE);
+            writtenBytes += chunk;
+            continue;
+        }
+        if(chunk == Geometry::SIZE){
+            //write whole blocks straight from data, nothing to read: one request per extent
+            size_t count = Geometry::block_of(length - writtenBytes);
+            if(run > count){
+                run = count;
             }
+            cache->write_blocks(bnum, run, data + writtenBytes);
+            writtenBytes += Geometry::bytes_of(run);
+            continue;
         }
+
+        //write part of block
+        cache->write_range(bnum, start, chunk, data + writtenBytes);
+        writtenBytes += chunk;
     }
+
+    //queued runs must reach the disk before the caller may reuse data
+    cache->wait();
+
+    if(offset + writtenBytes > inode->Size){
+        //stat reads the size without taking the inode lock
+        __atomic_store_n(&inode->Size, offset + writtenBytes, __ATOMIC_RELAXED);
+        node->Dirty = true;
+    }
+    //too much buffered data: the writer allocates its own
+    if(delayedBlocks >= DELAYED_BLOCKS){
+        flush_delayed(node);
+    }
+    return writtenBytes;
+}
+
+/**
+ * help function for inner_write
+ * copy @length bytes from @data to byte @start of unallocated logical block @b of @node, buffering the
+ * block (zero-filled) on first write and reserving a free block for it, plus the block map blocks it may
+ * take: the indirect block of the pointer format when the first block past the direct pointers is
+ * buffered, or the extent blocks needed if every buffered block ends up as an extent of its own that
+ * splits a hole in two. flush_delayed() can then always allocate what write() reported as written.
+ * return false if no block can be reserved or the file is as large as it can be
+ **/
+bool FileSystem::delay_block(OpenInode *node, size_t b, size_t start, size_t length, const char *data){
+    std::map<uint64_t, char *>::iterator it = node->Delayed.find(b);
+    if(it == node->Delayed.end()){
+        if(b >= max_file_blocks()){
+            return false;
+        }
+        size_t need = 1;
+        if(meta.Version == POINTER_VERSION && b >= POINTERS_PER_INODE && node->MapBlocks.empty() &&
+           node->Delayed.lower_bound(POINTERS_PER_INODE) == node->Delayed.end()){
+            need++;
+        }
+        if(meta.Version != POINTER_VERSION){
+            size_t extents = disk_extents(node) + 2 * node->Delayed.size();
+            need += extent_blocks(extents + 2) - extent_blocks(extents);
+        }
+        {
+            std::lock_guard<std::mutex> lock(alloc_lock);
+            if(free_block_map.size() - free_block_map.count() - reservedBlocks < need){
+                printf("disk is full.\n");
+                return false;
+            }
+            reservedBlocks += need;
+        }
+        char *block = (char *)calloc(1, Disk::BLOCK_SIZE);
+        if(block == NULL){
+            std::lock_guard<std::mutex> lock(alloc_lock);
+            reservedBlocks -= need;
+            return false;
+        }
+        node->Reserved += need;
+        it = node->Delayed.insert(std::make_pair((uint64_t)b, block)).first;
+        delayedBlocks++;
+    }
+    memcpy(it->second + start, data, length);
+    return true;
+}
+
+/**
+ * allocate the blocks buffered in @node->Delayed and write them: each run of consecutive logical blocks is
+ * mapped with map_blocks, which allocates it as one extent where the free space allows, and goes out with
+ * one request per extent. the data and block map blocks are taken out of @node->Reserved as they are
+ * allocated, so other writers never get them, and what the worst case did not use is handed back at the
+ * end. caller holds @node->Lock exclusively or the last reference to @node
+ **/
+void FileSystem::flush_delayed(OpenInode *node){
+    if(node->Delayed.empty()){
+        return;
+    }
+
+    Inode *inode = &inode_table[node->Inumber];
+    std::vector<char> buffer;
+    std::map<uint64_t, char *>::iterator it = node->Delayed.begin();
+    bool full = false;
+    while(it != node->Delayed.end() && !full){
+        //gather the run of consecutive logical blocks starting at it
+        uint64_t b = it->first;
+        size_t count = 0;
+        std::map<uint64_t, char *>::iterator last = it;
+        for(; last != node->Delayed.end() && last->first == b + count; last++, count++);
+        buffer.resize(count * Disk::BLOCK_SIZE);
+        size_t i = 0;
+        for(; it != last; it++, i++){
+            memcpy(&buffer[i * Disk::BLOCK_SIZE], it->second, Disk::BLOCK_SIZE);
+        }
+
+        size_t done = 0;
+        while(done < count){
+            size_t mapped;
+            bool fresh;
+            ssize_t bnum = map_blocks(node, b + done, count - done, &mapped, &fresh);
+            if(bnum < 0){
+                //not reachable while the reservation holds: keep the size consistent with what is mapped
+                uint64_t end = node->Extents.empty() ? 0 : node->Extents.back().Logical + node->Extents.back().Length;
+                if(end <= b + done && inode->Size > (b + done) * Disk::BLOCK_SIZE){
+                    __atomic_store_n(&inode->Size, (b + done) * Disk::BLOCK_SIZE, __ATOMIC_RELAXED);
+                }
+                full = true;
+                break;
+            }
+            cache->write_blocks(bnum, mapped, &buffer[done * Disk::BLOCK_SIZE]);
+            done += mapped;
+        }
+        //the buffer is refilled for the next run
+        cache->wait();
+    }
+
+    for(it = node->Delayed.begin(); it != node->Delayed.end(); it++){
+        free(it->second);
+    }
+    delayedBlocks -= node->Delayed.size();
+    node->Delayed.clear();
+    node->Dirty = true;
+    {
+        std::lock_guard<std::mutex> lock(alloc_lock);
+        reservedBlocks -= node->Reserved;
+    }
+    node->Reserved = 0;
+}
+
+//number of logical blocks a file can hold: as many as its size field can describe, in bytes that
+//still fit the ssize_t results of read and write
+size_t FileSystem::max_file_blocks() const{
+    if(meta.Version == POINTER_VERSION){
+        return POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+    }
+    if(meta.Version == EXTENT_VERSION){
+        return UINT32_MAX / Disk::BLOCK_SIZE;
+    }
+    return INT64_MAX / Disk::BLOCK_SIZE;
+}
+
+//number of extents the map of @node takes on disk, holes between them included
+size_t FileSystem::disk_extents(OpenInode *node){
+    size_t count = node->Extents.size();
+    uint64_t logical = 0;
+    size_t i = 0;
+    for(; i < node->Extents.size(); i++){
+        if(node->Extents[i].Logical > logical){
+            count++;
+        }
+        logical = node->Extents[i].Logical + node->Extents[i].Length;
+    }
+    return count;
+}
+
+//number of extent blocks holding @extents extents past those in the inode
+size_t FileSystem::extent_blocks(size_t extents) const{
+    if(extents <= INLINE_EXTENTS){
+        return 0;
+    }
+    size_t perBlock = extents_per_block(meta.Version);
+    return (extents - INLINE_EXTENTS + perBlock - 1) / perBlock;
+}
+
+//map up to @count logical blocks of @node from @b on. return the physical block behind @b and set *@mapped
+//to the number of blocks that follow it contiguously; if @b lay in a hole they were just allocated, as one
+//extent placed right after the preceding one where possible, and *@fresh is set. the indirect block is
+//allocated before the data it points to, an extent block once the extents no longer fit without it.
+//blocks come out of the reservation of @node's buffered writes first.
+//return -1 if the disk is full or the file is as large as it can be
+ssize_t FileSystem::map_blocks(OpenInode *node, size_t b, size_t count, size_t *mapped, bool *fresh){
+    size_t run;
+    uint64_t bnum = lookup(node, b, &run);
+    *fresh = false;
+    if(bnum){
+        *mapped = run < count ? run : count;
+        return bnum;
+    }
+    size_t limit = max_file_blocks();
+    if(b >= limit){
+        return -1;
+    }
+    if(count > run){
+        count = run;
+    }
+    if(count > limit - b){
+        count = limit - b;
+    }
+
+    if(meta.Version == POINTER_VERSION){
+        if(b < POINTERS_PER_INODE && count > POINTERS_PER_INODE - b){
+            count = POINTERS_PER_INODE - b;
+        }
+        if(b >= POINTERS_PER_INODE && node->MapBlocks.empty()){
+            ssize_t pointerBnum = allocate_free_block(&node->Reserved);
+            if(pointerBnum < 0){
+                return -1;
+            }
+            node->MapBlocks.push_back(pointerBnum);
+            node->Dirty = true;
+        }
+    }
+
+    //aim right after the extent before @b, so it is extended when the blocks after it are free; the
+    //first blocks of a file go to the allocation group of its inode
+    std::vector<FileExtent>::iterator next = std::lower_bound(node->Extents.begin(), node->Extents.end(), b,
+        [](const FileExtent &extent, size_t b){ return extent.Logical < b; });
+    size_t goal = group_goal(node->Inumber);
+    if(next != node->Extents.begin()){
+        goal = (next - 1)->Start + (next - 1)->Length;
+    }
+    ssize_t start = allocate_extent(goal, count, &count, node, &node->Reserved);
+    if(start < 0){
+        printf("disk is full.\n");
+        return -1;
+    }
+    std::vector<FileExtent> previous;
+    if(meta.Version != POINTER_VERSION){
+        previous = node->Extents;
+    }
+    FileExtent extent = {b, (uint64_t)start, count};
+    next = node->Extents.insert(next, extent);
+    if(next + 1 != node->Extents.end() && (next + 1)->Logical == b + count && (next + 1)->Start == extent.Start + count){
+        next->Length += (next + 1)->Length;
+        node->Extents.erase(next + 1);
+    }
+    if(next != node->Extents.begin() && (next - 1)->Logical + (next - 1)->Length == b && (next - 1)->Start + (next - 1)->Length == extent.Start){
+        (next - 1)->Length += next->Length;
+        node->Extents.erase(next);
+    }
+
+    //the extents may now overflow the inode and the extent blocks, chain another one
+    if(meta.Version != POINTER_VERSION && disk_extents(node) > INLINE_EXTENTS + node->MapBlocks.size() * extents_per_block(meta.Version)){
+        ssize_t extentBnum = allocate_free_block(&node->Reserved);
+        if(extentBnum < 0){
+            std::vector<FileExtent> run(1, extent);
+            release_blocks(run, std::vector<uint64_t>());
+            node->Extents.swap(previous);
+            return -1;
+        }
+        node->MapBlocks.push_back(extentBnum);
+    }
+    node->Dirty = true;
+    *fresh = true;
+    *mapped = count;
+    return start;
+}
+
+// Truncate inode --------------------------------------------------------------
+
+bool FileSystem::truncate(size_t inumber, size_t size){
+    if(!pre_requisite() || out_of_bound_inumber(inumber)){
+        return false;
+    }
+    if(Geometry::blocks_for(size) > max_file_blocks()){
+        return false;
+    }
+    OpenInode *node = get_inode(inumber);
+    if(node == NULL){
+        return false;
+    }
+    bool result = false;
+    {
+        WriteGuard guard(node->Lock);
+        result = inner_truncate(node, size);
+    }
+    put_inode(node);
+    return result;
+}
+
+/**
+ * help function for truncate
+ * set the size of @node to @size. growing the file leaves a hole; shrinking it drops the buffered blocks
+ * past the new end, zeroes the rest of its last block or of its inline data (so growing it again reads
+ * zeros there) and frees the blocks past it once the shorter block map is saved, so they are never
+ * reused while the inode on disk still points to them. the map blocks are kept, like those left over
+ * from merged extents.
+ * caller holds @node->Lock exclusively
+ **/
+bool FileSystem::inner_truncate(OpenInode *node, size_t size){
+    Inode *inode = &inode_table[node->Inumber];
+    if(size >= inode->Size){
+        if(size > INLINE_DATA && is_inline(node) && !move_inline(node)){
+            return false;
+        }
+        __atomic_store_n(&inode->Size, size, __ATOMIC_RELAXED);
+        node->Dirty = true;
+        return true;
+    }
+
+    static const char zeros[Disk::BLOCK_SIZE] = {0};
+    std::vector<FileExtent> freed;
+    bool wasInline = is_inline(node);
+    if(!wasInline){
+        //buffered blocks past the end go away, their reservation with the rest at the next flush
+        size_t end = Geometry::blocks_for(size);
+        std::map<uint64_t, char *>::iterator it = node->Delayed.lower_bound(end);
+        while(it != node->Delayed.end()){
+            free(it->second);
+            it = node->Delayed.erase(it);
+            delayedBlocks--;
+        }
+        if(node->Delayed.empty() && node->Reserved){
+            std::lock_guard<std::mutex> lock(alloc_lock);
+            reservedBlocks -= node->Reserved;
+            node->Reserved = 0;
+        }
+
+        size_t tail = Geometry::offset_in(size);
+        if(tail){
+            size_t run;
+            uint64_t bnum = lookup(node, end - 1, &run);
+            it = node->Delayed.find(end - 1);
+            if(bnum){
+                cache->write_range(bnum, tail, Geometry::SIZE - tail, zeros);
+            }
+            else if(it != node->Delayed.end()){
+                memset(it->second + tail, 0, Geometry::SIZE - tail);
+            }
+        }
+
+        //cut the extents at the new end
+        while(!node->Extents.empty() && node->Extents.back().Logical + node->Extents.back().Length > end){
+            FileExtent &last = node->Extents.back();
+            if(last.Logical >= end){
+                freed.push_back(last);
+                node->Extents.pop_back();
+                continue;
+            }
+            FileExtent cut = {end, last.Start + (end - last.Logical), last.Logical + last.Length - end};
+            freed.push_back(cut);
+            last.Length = end - last.Logical;
+        }
+    }
+    __atomic_store_n(&inode->Size, size, __ATOMIC_RELAXED);
+    if(is_inline(node)){
+        //the bytes past the end read as zeros if the file grows again, all of them if it just shrank
+        //back into its inode and the data left there is stale
+        size_t from = wasInline ? size : 0;
+        MetadataUpdate update(this, 1);
+        inline_range(node->Inumber, from, INLINE_DATA - from, (char *)zeros, true);
+    }
+    save_block_map(node);
+    if(!freed.empty()){
+        release_blocks(freed, std::vector<uint64_t>());
+    }
+    return true;
+}
+
+/**
+ * help function for inner_write and inner_truncate
+ * move the data of inline @node, which is about to outgrow its inode, to a buffered first block.
+ * return false if no block can be reserved for it
+ **/
+bool FileSystem::move_inline(OpenInode *node){
+    size_t size = inode_table[node->Inumber].Size;
+    if(size == 0){
+        return true;
+    }
+    char head[INLINE_DATA];
+    inline_range(node->Inumber, 0, size, head, false);
+    return delay_block(node, 0, 0, size, head);
+}
+
+// File handles ----------------------------------------------------------------
+
+ssize_t FileSystem::open(size_t inumber){
+    if(!pre_requisite() || out_of_bound_inumber(inumber)){
+        return -1;
+    }
+    OpenInode *node = get_inode(inumber);
+    if(node == NULL){
+        return -1;
+    }
+    FileHandle *fh = new FileHandle;
+    fh->Node = node;
+    fh->Position = 0;
+
+    //reuse the lowest closed handle
+    std::lock_guard<std::mutex> lock(table_lock);
+    size_t handle = 0;
+    for(; handle < open_handles.size() && open_handles[handle]; handle++);
+    if(handle == open_handles.size()){
+        open_handles.push_back(fh);
+    }
+    else{
+        open_handles[handle] = fh;
+    }
+    return handle;
+}
+
+bool FileSystem::close(size_t handle){
+    FileHandle *fh = get_handle(handle);
+    if(fh == NULL){
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(table_lock);
+        open_handles[handle] = NULL;
+    }
+    put_inode(fh->Node);
+    delete fh;
+    return true;
+}
+
+ssize_t FileSystem::read(size_t handle, char *data, size_t length){
+    StatsTimer timer(Stats::READ);
+    FileHandle *fh = get_handle(handle);
+    if(fh == NULL){
+        return -1;
+    }
+    ReadGuard guard(fh->Node->Lock);
+    size_t size = inode_table[fh->Node->Inumber].Size;
+    if(fh->Position >= size){
+        return 0;
+    }
+    if(length > size - fh->Position){
+        length = size - fh->Position;
+    }
+    size_t readBytes = inner_read(fh->Node, data, length, fh->Position);
+    Stats::transferred(Stats::READ, readBytes);
+    fh->Position += readBytes;
+    return readBytes;
+}
+
+ssize_t FileSystem::write(size_t handle, char *data, size_t length){
+    StatsTimer timer(Stats::WRITE);
+    FileHandle *fh = get_handle(handle);
+    if(fh == NULL){
+        return -1;
+    }
+    WriteGuard guard(fh->Node->Lock);
+    size_t writtenBytes = inner_write(fh->Node, data, length, fh->Position);
+    Stats::transferred(Stats::WRITE, writtenBytes);
+    fh->Position += writtenBytes;
     return writtenBytes;
 }
 
+ssize_t FileSystem::seek(size_t handle, size_t offset, int whence){
+    FileHandle *fh = get_handle(handle);
+    if(fh == NULL){
+        return -1;
+    }
+    ReadGuard guard(fh->Node->Lock);
+    if(whence == SEEK_DATA || whence == SEEK_HOLE){
+        ssize_t next = find_data(fh->Node, offset, whence == SEEK_HOLE);
+        if(next < 0){
+            return -1;
+        }
+        offset = next;
+    }
+    else if(whence != SEEK_SET){
+        return -1;
+    }
+    //the position may lie past the end of the file, a write there leaves a hole
+    fh->Position = offset;
+    return offset;
+}
+
+//return the first offset from @offset on that lies in data (@hole false) or in a hole (@hole true) of @node.
+//buffered blocks count as data and the end of the file as a hole; -1 if @offset is not below the size or
+//no data follows it. caller holds @node->Lock
+ssize_t FileSystem::find_data(OpenInode *node, size_t offset, bool hole){
+    size_t size = inode_table[node->Inumber].Size;
+    if(offset >= size){
+        return -1;
+    }
+    if(is_inline(node)){
+        return hole ? size : offset;
+    }
+    size_t b = Geometry::block_of(offset);
+    while(b < Geometry::blocks_for(size)){
+        size_t run;
+        bool data = lookup(node, b, &run) != 0;
+        if(!data){
+            //buffered blocks split the hole
+            std::map<uint64_t, char *>::iterator it = node->Delayed.lower_bound(b);
+            if(it != node->Delayed.end() && it->first == b){
+                data = true;
+                run = 1;
+            }
+            else if(it != node->Delayed.end() && it->first - b < run){
+                run = it->first - b;
+            }
+        }
+        if(data != hole){
+            return Geometry::bytes_of(b) > offset ? Geometry::bytes_of(b) : offset;
+        }
+        if(run > (SIZE_MAX >> Geometry::SHIFT) - b){
+            break;
+        }
+        b += run;
+    }
+    return hole ? (ssize_t)size : -1;
+}
+
+//return the open file behind @handle, NULL if it is not open
+FileSystem::FileHandle *FileSystem::get_handle(size_t handle){
+    if(!pre_requisite()){
+        return NULL;
+    }
+    std::lock_guard<std::mutex> lock(table_lock);
+    if(handle >= open_handles.size()){
+        return NULL;
+    }
+    return open_handles[handle];
+}
+
+//return the in-core inode of @inumber, resolving its block map on first use; NULL if it is not valid
+FileSystem::OpenInode *FileSystem::get_inode(size_t inumber){
+    std::lock_guard<std::mutex> lock(table_lock);
+    if(!inode_table[inumber].Valid){
+        return NULL;
+    }
+    std::unordered_map<size_t, OpenInode *>::iterator it = open_inodes.find(inumber);
+    if(it != open_inodes.end()){
+        it->second->References++;
+        return it->second;
+    }
+    OpenInode *node = new OpenInode;
+    node->Inumber = inumber;
+    node->References = 1;
+    node->Dirty = false;
+    node->Reserved = 0;
+    node->NextOffset = 0;
+    node->Window = 0;
+    node->ReadaheadEnd = 0;
+    node->PreallocStart = 0;
+    node->PreallocEnd = 0;
+    load_block_map(&inode_table[inumber], node->Extents, node->MapBlocks, false);
+    open_inodes[inumber] = node;
+    return node;
+}
+
+//drop a reference to @node, saving its block map when the last user goes away
+void FileSystem::put_inode(OpenInode *node){
+    //the block map is saved before the inode leaves open_inodes, so get_inode never loads a stale one
+    std::lock_guard<std::mutex> lock(table_lock);
+    if(--node->References > 0){
+        return;
+    }
+    flush_delayed(node);
+    if(node->Dirty){
+        save_block_map(node);
+    }
+    release_prealloc(node);
+    open_inodes.erase(node->Inumber);
+    delete node;
+}
+
+//append the extent of @length blocks from @start at logical block @logical to @extents, merging it
+//with the last one when they are contiguous
+void FileSystem::append_extent(std::vector<FileExtent> &extents, uint64_t logical, uint64_t start, uint64_t length){
+    if(!extents.empty()){
+        FileExtent &last = extents.back();
+        if(last.Logical + last.Length == logical && last.Start + last.Length == start){
+            last.Length += length;
+            return;
+        }
+    }
+    FileExtent extent = {logical, start, length};
+    extents.push_back(extent);
+}
+
+//collect the allocated extents of @inode in file order and the blocks holding its map (indirect block or
+//extent blocks). blocks off the disk are left out; @scan reads map blocks straight from disk for mount
+void FileSystem::load_block_map(const Inode *inode, std::vector<FileExtent> &extents, std::vector<uint64_t> &mapBlocks, bool scan){
+    extents.clear();
+    mapBlocks.clear();
+    Block block;
+    if(meta.Version == POINTER_VERSION){
+        uint32_t b = 0;
+        for(; b < POINTERS_PER_INODE; b++){
+            if(inode->Direct[b] && inode->Direct[b] < meta.Blocks){
+                append_extent(extents, b, inode->Direct[b], 1);
+            }
+        }
+        if(inode->Indirect && inode->Indirect < meta.Blocks){
+            mapBlocks.push_back(inode->Indirect);
+            read_map_block(inode->Indirect, &block, scan);
+            for(b = 0; b < POINTERS_PER_BLOCK; b++){
+                if(block.Pointers[b] && block.Pointers[b] < meta.Blocks){
+                    append_extent(extents, POINTERS_PER_INODE + b, block.Pointers[b], 1);
+                }
+            }
+        }
+        return;
+    }
+
+    //extents follow each other in the file, holes have no start block
+    std::vector<Extent> stored(inode->Extents, inode->Extents + (inode->ExtentCount < INLINE_EXTENTS ? inode->ExtentCount : INLINE_EXTENTS));
+    uint64_t next = inode->Overflow;
+    while(stored.size() < inode->ExtentCount && next && next < meta.Blocks && mapBlocks.size() < inode->ExtentCount){
+        mapBlocks.push_back(next);
+        read_map_block(next, &block, scan);
+        load_extent_block(&block, meta.Version, stored, &next);
+    }
+    uint64_t logical = 0;
+    size_t n = 0;
+    for(; n < stored.size() && n < inode->ExtentCount; n++){
+        const Extent &extent = stored[n];
+        if(extent.Start && extent.Start < meta.Blocks && extent.Length <= meta.Blocks - extent.Start){
+            append_extent(extents, logical, extent.Start, extent.Length);
+        }
+        logical += extent.Length;
+    }
+}
+
+//read map block @bnum into @buffer through the cache, or straight from disk when @scan (seeding the cache)
+void FileSystem::read_map_block(uint64_t bnum, Block *buffer, bool scan){
+    if(scan){
+        currMountedDisk->read(bnum, buffer->Data);
+        cache->insert(bnum, buffer->Data);
+    }
+    else{
+        cache->read_range(bnum, 0, Disk::BLOCK_SIZE, buffer->Data);
+    }
+}
+
+//write the block map of @node back to its inode and map blocks, then save the inode
+void FileSystem::save_block_map(OpenInode *node){
+    //the map blocks and the inode are committed together
+    MetadataUpdate update(this, node->MapBlocks.size() + 1);
+    Inode *inode = &inode_table[node->Inumber];
+    if(meta.Version != POINTER_VERSION){
+        save_extents(node);
+    }
+    else{
+        size_t run;
+        uint32_t d = 0;
+        for(; d < POINTERS_PER_INODE; d++){
+            inode->Direct[d] = lookup(node, d, &run);
+        }
+        //map_blocks allocates the indirect block before the first indirect data block
+        inode->Indirect = node->MapBlocks.empty() ? 0 : node->MapBlocks[0];
+        if(inode->Indirect){
+            Block pointerBlock;
+            memset(pointerBlock.Data, 0, Disk::BLOCK_SIZE);
+            size_t i = 0;
+            for(; i < node->Extents.size(); i++){
+                const FileExtent &extent = node->Extents[i];
+                uint64_t b = extent.Logical < POINTERS_PER_INODE ? POINTERS_PER_INODE : extent.Logical;
+                for(; b < extent.Logical + extent.Length; b++){
+                    pointerBlock.Pointers[b - POINTERS_PER_INODE] = extent.Start + (b - extent.Logical);
+                }
+            }
+            write_metadata(inode->Indirect, 0, Disk::BLOCK_SIZE, pointerBlock.Data);
+        }
+    }
+    save_inode(node->Inumber, inode);
+    node->Dirty = false;
+}
+
+//store the extents of @node, holes included, in its inode and then its chain of extent blocks.
+//map_blocks allocates the extent blocks as the extents need them
+void FileSystem::save_extents(OpenInode *node){
+    Inode *inode = &inode_table[node->Inumber];
+    std::vector<Extent> extents;
+    uint64_t logical = 0;
+    size_t i = 0;
+    for(; i < node->Extents.size(); i++){
+        const FileExtent &extent = node->Extents[i];
+        if(extent.Logical > logical){
+            Extent hole = {0, extent.Logical - logical};
+            extents.push_back(hole);
+        }
+        Extent allocated = {extent.Start, extent.Length};
+        extents.push_back(allocated);
+        logical = extent.Logical + extent.Length;
+    }
+
+    memset(inode->Extents, 0, sizeof(inode->Extents));
+    inode->ExtentCount = extents.size();
+    inode->Overflow = node->MapBlocks.empty() ? 0 : node->MapBlocks[0];
+    size_t n = 0;
+    for(; n < extents.size() && n < INLINE_EXTENTS; n++){
+        inode->Extents[n] = extents[n];
+    }
+    //every block of the chain is rewritten, blocks left over from merged extents stay in it empty
+    size_t perBlock = extents_per_block(meta.Version);
+    Block extentBlock;
+    for(i = 0; i < node->MapBlocks.size(); i++){
+        size_t count = extents.size() - n < perBlock ? extents.size() - n : perBlock;
+        uint64_t next = i + 1 < node->MapBlocks.size() ? node->MapBlocks[i + 1] : 0;
+        store_extent_block(extents.data() + n, count, next, meta.Version, &extentBlock);
+        write_metadata(node->MapBlocks[i], 0, Disk::BLOCK_SIZE, extentBlock.Data);
+        n += count;
+    }
+}
+
+//close every handle and save the block maps of open files
+void FileSystem::release_handles(){
+    size_t handle = 0;
+    for(; handle < open_handles.size(); handle++){
+        close(handle);
+    }
+    open_handles.clear();
+}
 
 //allocate a free block and return block number, return -1 if full or other error
-ssize_t FileSystem::allocate_free_block(){
-    size_t bnum = (size_t)ceil((double)currMountedDisk->size() * 0.1) + 1;//find from the first data block
-    for(; bnum < currMountedDisk->size(); bnum++){
-        if(free_block_map[bnum] == 0){
-            free_block_map[bnum] = 1;
+ssize_t FileSystem::allocate_free_block(size_t *reserve){
+    size_t count;
+    ssize_t bnum = allocate_extent(0, 1, &count, NULL, reserve);
+    if(bnum < 0){
+        printf("disk is full.\n");
+    }
+    return bnum;
+}
+
+//allocate a run of up to @max contiguous free blocks and return the first block number, setting *@count
+//to its length; return -1 if the disk is full. the run starts at the first free block from @goal on (0 for
+//no goal: from where the last allocation ended), wrapping around to the first data block. the preallocation
+//windows of other files are left alone while there are free blocks outside them; @owner (NULL for metadata)
+//then gets the free blocks after the run as its own window, so its next allocation continues it. the blocks
+//count against the reservation *@reserve (NULL for none) first, which shrinks by as many
+ssize_t FileSystem::allocate_extent(size_t goal, size_t max, size_t *count, OpenInode *owner, size_t *reserve){
+    std::lock_guard<std::mutex> lock(alloc_lock);
+    //blocks reserved by others are off limits, those of the caller are its to take
+    size_t held = reserve ? *reserve : 0;
+    size_t available = free_block_map.size() - free_block_map.count() - reservedBlocks + held;
+    if(max > available){
+        max = available;
+    }
+    if(max == 0){
+        allocStats.Failures++;
+        return -1;
+    }
+    size_t from = goal >= dataStart && goal < meta.Blocks ? goal : allocHint;
+    bool windows = true;
+    ssize_t bnum = find_free(from, meta.Blocks, owner);
+    if(bnum < 0){
+        bnum = find_free(dataStart, from, owner);
+    }
+    if(bnum < 0){
+        //only the windows are left: take from them
+        windows = false;
+        bnum = free_block_map.find_clear(from, meta.Blocks);
+        if(bnum < 0){
+            bnum = free_block_map.find_clear(dataStart, from);
+        }
+    }
+    if(bnum < 0){
+        allocStats.Failures++;
+        return -1;
+    }
+    size_t end = (size_t)(meta.Blocks - bnum) < max ? meta.Blocks : bnum + max;
+    ssize_t used = free_block_map.find_set(bnum, end);
+    if(used >= 0){
+        end = used;
+    }
+    std::map<uint64_t, uint64_t>::iterator window = preallocWindows.upper_bound(bnum);
+    if(windows && window != preallocWindows.end() && window->first < end && !owns_window(owner, window->first)){
+        end = window->first;
+    }
+    size_t b = bnum;
+    for(; b < end; b++){
+        free_block_map.set(b);
+    }
+    allocHint = end < meta.Blocks ? end : dataStart;
+    *count = end - bnum;
+    allocStats.Extents++;
+    allocStats.Blocks += *count;
+    if(held){
+        held = held < *count ? held : *count;
+        *reserve -= held;
+        reservedBlocks -= held;
+    }
+
+    if(owner){
+        //move the window of @owner past the run, up to the next used block or window
+        if(owner->PreallocEnd > owner->PreallocStart){
+            preallocWindows.erase(owner->PreallocStart);
+        }
+        size_t windowEnd = (size_t)(meta.Blocks - end) < PREALLOC_BLOCKS ? meta.Blocks : end + PREALLOC_BLOCKS;
+        used = free_block_map.find_set(end, windowEnd);
+        if(used >= 0){
+            windowEnd = used;
+        }
+        window = preallocWindows.lower_bound(end);
+        if(window != preallocWindows.end() && window->first < windowEnd){
+            windowEnd = window->first;
+        }
+        if(!windows){
+            windowEnd = end;
+        }
+        owner->PreallocStart = end;
+        owner->PreallocEnd = windowEnd;
+        if(windowEnd > end){
+            preallocWindows[end] = windowEnd;
+        }
+    }
+    return bnum;
+}
+
+//return the first free block in [@from, @to) outside the preallocation windows of files other than
+//@owner, -1 if there is none (under alloc_lock)
+ssize_t FileSystem::find_free(size_t from, size_t to, const OpenInode *owner){
+    while(from < to){
+        ssize_t bnum = free_block_map.find_clear(from, to);
+        if(bnum < 0){
+            return -1;
+        }
+        std::map<uint64_t, uint64_t>::iterator window = preallocWindows.upper_bound(bnum);
+        if(window == preallocWindows.begin()){
+            return bnum;
+        }
+        window--;
+        if((size_t)bnum >= window->second || owns_window(owner, window->first)){
             return bnum;
         }
+        from = window->second;
     }
-    printf("disk is full.\n");
     return -1;
 }
 
+//whether the preallocation window starting at @start belongs to @owner (under alloc_lock)
+bool FileSystem::owns_window(const OpenInode *owner, size_t start){
+    return owner && owner->PreallocEnd > owner->PreallocStart && owner->PreallocStart == start;
+}
+
+//give the preallocation window of @node back to other files
+void FileSystem::release_prealloc(OpenInode *node){
+    std::lock_guard<std::mutex> lock(alloc_lock);
+    if(node->PreallocEnd > node->PreallocStart){
+        preallocWindows.erase(node->PreallocStart);
+    }
+    node->PreallocStart = node->PreallocEnd = 0;
+}
+
+//return the block where the first data of inode @inumber goes: the data blocks are split into groups of
+//ALLOC_GROUP_BLOCKS and the inodes spread evenly over them, so files created far apart in the inode
+//table start far apart on disk and have room to grow. 0 (next fit) if the disk holds a single group
+size_t FileSystem::group_goal(size_t inumber) const{
+    size_t groups = (meta.Blocks - dataStart) / ALLOC_GROUP_BLOCKS;
+    if(groups < 2 || meta.Inodes == 0){
+        return 0;
+    }
+    return dataStart + inumber * groups / meta.Inodes * ALLOC_GROUP_BLOCKS;
+}
+
 
 FileSystem::~FileSystem(){
-        free(free_block_map);
-        free(inode_table);
+        unmount();
+}
+
+//write back every dirty block held by the cache
+void FileSystem::sync(){
+    if(cache){
+        //pin the open inodes, then save each one under its own lock
+        std::vector<OpenInode *> nodes;
+        {
+            std::lock_guard<std::mutex> lock(table_lock);
+            std::unordered_map<size_t, OpenInode *>::iterator it = open_inodes.begin();
+            for(; it != open_inodes.end(); it++){
+                it->second->References++;
+                nodes.push_back(it->second);
+            }
+        }
+        size_t i = 0;
+        for(; i < nodes.size(); i++){
+            {
+                WriteGuard guard(nodes[i]->Lock);
+                flush_delayed(nodes[i]);
+                if(nodes[i]->Dirty){
+                    save_block_map(nodes[i]);
+                }
+            }
+            put_inode(nodes[i]);
+        }
+        if(journal){
+            commit_journal();
+        }
+        if(meta.BitmapBlocks){
+            save_bitmaps();
+        }
+        cache->flush();
+        currMountedDisk->sync();
+    }
 }
 
 bool FileSystem::save_inode(size_t inumber, Inode *node){
     if(out_of_bound_inumber(inumber)){
         return false;
     }
-    Block inodeBlock;
-    int bnum = 1 + inumber/INODES_PER_BLOCK;
-    int index = inumber % INODES_PER_BLOCK;
-    currMountedDisk->read(bnum, inodeBlock.Data);
-    memcpy(&(inodeBlock.Inodes[index]), node, sizeof(Inode));
-    currMountedDisk->write(bnum, inodeBlock.Data);
+    size_t bnum = 1 + inumber / inodesPerBlock;
+    size_t index = inumber % inodesPerBlock;
+    //update the inode in place in the cached inode block
+    char raw[sizeof(Inode)];
+    store_inode(*node, meta.Version, raw);
+    //the inline data after an INLINE_VERSION inode is left alone
+    write_metadata(bnum, index * inodeSize, inodeSize < sizeof(Inode) ? inodeSize : sizeof(Inode), raw);
     return true;
 }
 
-bool FileSystem::load_inode(size_t inumber, Inode *node){
-    if(out_of_bound_inumber(inumber)){
-        return false;
+//update part of a metadata block through the cache, pinning it for the next commit if there is a journal.
+//caller holds a MetadataUpdate
+void FileSystem::write_metadata(size_t blocknum, size_t offset, size_t length, const char *data){
+    if(journal == NULL || metadataInPlace){
+        cache->write_range(blocknum, offset, length, data, length == Disk::BLOCK_SIZE);
+        return;
     }
-    Block inodeBlock;
-    int bnum = 1 + inumber/INODES_PER_BLOCK;
-    int index = inumber % INODES_PER_BLOCK;
-    currMountedDisk->read(bnum, inodeBlock.Data);
-    memcpy(node, &(inodeBlock.Inodes[index]), sizeof(Inode));
-    return true;
+    cache->write_pinned(blocknum, offset, length, data);
+    if(cache->pinned() >= commitThreshold){
+        commit_wakeup.notify_one();
+    }
+}
+
+//reserve room in the cache for the @blocks blocks an update is about to pin: held blocks stay cached until
+//their transaction is logged, so the journal is committed while the blocks pinned and reserved would leave
+//less than half of the cache to evict. an update larger than that waits until it runs alone and writes its
+//blocks in place after a checkpoint, as safe as having no journal (like a transaction too large for the log).
+//caller does not hold journal_lock
+void FileSystem::make_room(size_t blocks){
+    if(journal == NULL){
+        return;
+    }
+    size_t half = cache->capacity() / 2;
+    std::unique_lock<std::mutex> lock(room_lock);
+    while(roomBlocks + cache->pinned() > 0 && roomBlocks + cache->pinned() + blocks > half){
+        lock.unlock();
+        commit_journal();
+        lock.lock();
+    }
+    roomBlocks += blocks;
+    if(blocks > half){
+        std::lock_guard<std::mutex> commitLock(commit_lock);
+        journal->checkpoint();
+        metadataInPlace = true;
+    }
+}
+
+//give back the room of an update reserved by make_room
+void FileSystem::free_room(size_t blocks){
+    if(journal == NULL){
+        return;
+    }
+    std::lock_guard<std::mutex> lock(room_lock);
+    roomBlocks -= blocks;
+    if(blocks > cache->capacity() / 2){
+        metadataInPlace = false;
+    }
+}
+
+//log every pinned metadata block as one transaction, then release the blocks freed by the operations in it
+void FileSystem::commit_journal(){
+    std::lock_guard<std::mutex> lock(commit_lock);
+    std::vector<size_t> blocks;
+    std::vector<char> images;
+    std::vector<FileExtent> extents;
+    std::vector<uint64_t> mapBlocks;
+    {
+        //operations pin their blocks holding journal_lock shared, so none is collected half done
+        WriteGuard barrier(journal_lock);
+        cache->collect(blocks, images);
+        std::lock_guard<std::mutex> allocLock(alloc_lock);
+        extents.swap(freedExtents);
+        mapBlocks.swap(freedMapBlocks);
+    }
+    journal->commit(blocks, images);
+    std::lock_guard<std::mutex> allocLock(alloc_lock);
+    allocStats.Freed += mark_free(&free_block_map, extents, mapBlocks);
+}
+
+//journal committer: group the operations of every COMMIT_INTERVAL into one commit, or commit
+//sooner once commitThreshold blocks are pinned
+void FileSystem::run_committer(){
+    std::unique_lock<std::mutex> lock(committer_lock);
+    while(!stopCommitter){
+        commit_wakeup.wait_for(lock, std::chrono::milliseconds((int)COMMIT_INTERVAL));
+        if(stopCommitter){
+            break;
+        }
+        lock.unlock();
+        try{
+            commit_journal();
+        }
+        catch(const std::exception &e){
+            fprintf(stderr, "journal commit failed: %s\n", e.what());
+        }
+        lock.lock();
+    }
+}
+
+//whether the data of @node lives in its inode: INLINE_VERSION files that fit and were never given a block
+bool FileSystem::is_inline(OpenInode *node){
+    return meta.Version == INLINE_VERSION && node->Extents.empty() && node->Delayed.empty() &&
+           inode_table[node->Inumber].Size <= INLINE_DATA;
+}
+
+//copy @length bytes at byte @offset of the inline data of @inumber to (@write false) or from @data,
+//through the cached inode block. a writer holds a MetadataUpdate
+void FileSystem::inline_range(size_t inumber, size_t offset, size_t length, char *data, bool write){
+    size_t bnum = 1 + inumber / inodesPerBlock;
+    size_t start = (inumber % inodesPerBlock) * inodeSize + sizeof(Inode) + offset;
+    if(write){
+        write_metadata(bnum, start, length, data);
+    }
+    else{
+        cache->read_range(bnum, start, length, data);
+    }
+}
+
+FileSystem::AllocatorStats FileSystem::allocator_stats() const{
+    std::lock_guard<std::mutex> lock(alloc_lock);
+    return allocStats;
+}
+
+void FileSystem::reset_stats(){
+    Stats::reset();
+    if(cache){
+        cache->reset_stats();
+    }
+    std::lock_guard<std::mutex> lock(alloc_lock);
+    allocStats = AllocatorStats();
 }
 
 //test if inumber is out of the bound
 bool FileSystem::out_of_bound_inumber(size_t inumber){
-    size_t inodes = (size_t)ceil((double)currMountedDisk->size() * 0.1) * INODES_PER_BLOCK;//length of inode table
-    return inumber < 0 || inumber >= inodes;
+    return inumber >= meta.Inodes;
 }
 
 //pre-requisite for various operations which depend on mounted disk
 bool FileSystem::pre_requisite(){
-    return currMountedDisk != NULL && free_block_map != NULL && inode_table != NULL;
+    return currMountedDisk != NULL && cache != NULL && inode_table != NULL;
 }
\ No newline at end of file
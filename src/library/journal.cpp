@@ -0,0 +1,262 @@
+// journal.cpp: write-ahead metadata journal
+
+#include "sfs/journal.h"
+
+#include <stdexcept>
+#include <unordered_map>
+
+#include <string.h>
+#include <time.h>
+
+// FNV-1a over one block
+static uint64_t checksum(uint64_t hash, const char *data) {
+    for (size_t i = 0; i < Disk::BLOCK_SIZE; i++) {
+    	hash ^= (unsigned char)data[i];
+    	hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static const uint64_t CHECKSUM_SEED = 0xcbf29ce484222325ULL;
+
+Journal::Journal(Disk *disk, BlockCache *cache, uint64_t start, uint64_t blocks)
+    : disk(disk), cache(cache), Start(start), Area(blocks - 1), Head(0), Tail(0), Sequence(0), TailSequence(0),
+      Commits(0), Logged(0), Checkpoints(0), Overflows(0) {
+    if (blocks < MIN_BLOCKS) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Journal of %lu blocks is too small", blocks);
+    	throw std::invalid_argument(what);
+    }
+}
+
+void Journal::format(Disk *disk, uint64_t start, uint64_t blocks) {
+    char block[Disk::BLOCK_SIZE];
+
+    // A fresh sequence keeps transactions left by an earlier file system from replaying
+    memset(block, 0, Disk::BLOCK_SIZE);
+    Header *header	= (Header *)block;
+    header->MagicNumber = MAGIC_NUMBER;
+    header->Type	= HEADER;
+    header->Sequence	= (uint64_t)time(NULL) << 16;
+    header->Tail	= 0;
+    disk->zero(start + 1, blocks - 1);
+    disk->write(start, block);
+}
+
+void Journal::transfer_log(uint64_t position, size_t count, char *data, bool write) {
+    while (count > 0) {
+    	uint64_t offset = position % Area;
+    	size_t   run    = Area - offset < count ? Area - offset : count;
+    	if (write) {
+    	    disk->write_blocks(Start + 1 + offset, run, data);
+	} else {
+    	    disk->read_blocks(Start + 1 + offset, run, data);
+	}
+    	position += run;
+    	count    -= run;
+    	data	 += run * Disk::BLOCK_SIZE;
+    }
+}
+
+void Journal::write_header() {
+    char block[Disk::BLOCK_SIZE];
+
+    memset(block, 0, Disk::BLOCK_SIZE);
+    Header *header	= (Header *)block;
+    header->MagicNumber = MAGIC_NUMBER;
+    header->Type	= HEADER;
+    header->Sequence	= TailSequence;
+    header->Tail	= Tail % Area;
+    disk->write(Start, block);
+}
+
+size_t Journal::read_transaction(uint64_t position, uint64_t sequence, std::vector<uint64_t> &blocks, std::vector<uint64_t> &positions) {
+    char     block[Disk::BLOCK_SIZE];
+    uint64_t hash = CHECKSUM_SEED;
+
+    blocks.clear();
+    positions.clear();
+    for (size_t length = 0; length < Area; ) {
+    	transfer_log(position + length, 1, block, false);
+    	const Descriptor *descriptor = (const Descriptor *)block;
+    	if (descriptor->MagicNumber != MAGIC_NUMBER || descriptor->Sequence != sequence) {
+    	    return 0;
+	}
+
+    	if (descriptor->Type == COMMIT) {
+    	    const Commit *commit = (const Commit *)block;
+    	    if (blocks.empty() || commit->Count != blocks.size() || commit->Checksum != hash) {
+    	    	return 0;
+	    }
+    	    return length + 1;
+	}
+
+    	// Each descriptor and its images must fit the log with the commit block after them
+    	if (descriptor->Type != DESCRIPTOR || descriptor->Count == 0 || descriptor->Count > DESCRIPTOR_BLOCKS ||
+    	    length + 1 + descriptor->Count + 1 > Area) {
+    	    return 0;
+	}
+    	for (size_t i = 0; i < descriptor->Count; i++) {
+    	    uint64_t blocknum = descriptor->Blocks[i];
+    	    if (blocknum >= disk->size() || (blocknum >= Start && blocknum <= Start + Area)) {
+    	    	return 0;
+	    }
+    	    blocks.push_back(blocknum);
+    	    positions.push_back(position + length + 1 + i);
+	}
+    	hash = checksum(hash, block);
+
+    	size_t count = descriptor->Count;
+    	length++;
+    	for (size_t i = 0; i < count; i++, length++) {
+    	    transfer_log(position + length, 1, block, false);
+    	    hash = checksum(hash, block);
+	}
+    }
+    return 0;
+}
+
+ssize_t Journal::replay() {
+    char block[Disk::BLOCK_SIZE];
+
+    disk->read(Start, block);
+    const Header *header = (const Header *)block;
+    if (header->MagicNumber != MAGIC_NUMBER || header->Type != HEADER || header->Tail >= Area) {
+    	return -1;
+    }
+    Sequence = TailSequence = header->Sequence;
+    Head     = Tail = header->Tail;
+
+    // Later transactions may rewrite the same blocks, so they are applied in order
+    std::vector<uint64_t> blocks;
+    std::vector<uint64_t> positions;
+    ssize_t transactions = 0;
+    size_t  length;
+    while ((length = read_transaction(Head, Sequence, blocks, positions)) > 0) {
+    	for (size_t i = 0; i < blocks.size(); i++) {
+    	    transfer_log(positions[i], 1, block, false);
+    	    disk->write(blocks[i], block);
+	}
+    	Head += length;
+    	Sequence++;
+    	transactions++;
+    }
+
+    if (transactions > 0) {
+    	disk->sync();
+    	Tail	     = Head;
+    	TailSequence = Sequence;
+    	write_header();
+    	disk->sync();
+    }
+    return transactions;
+}
+
+void Journal::commit(const std::vector<size_t> &blocks, const std::vector<char> &images) {
+    if (blocks.empty()) {
+    	return;
+    }
+
+    size_t count       = blocks.size();
+    size_t descriptors = (count + DESCRIPTOR_BLOCKS - 1) / DESCRIPTOR_BLOCKS;
+    size_t length      = descriptors + count + 1;
+    if (length > Area) {
+    	// Too large to log: write it in place, which is as safe as having no journal
+    	checkpoint();
+    	for (size_t i = 0; i < count; i++) {
+    	    disk->write(blocks[i], (char *)images.data() + i * Disk::BLOCK_SIZE);
+	}
+    	disk->sync();
+    	cache->release();
+    	Overflows++;
+    	return;
+    }
+    if (Head - Tail + length > Area) {
+    	checkpoint();
+    }
+
+    // Ordered: everything the transaction may point to reaches the disk before it
+    cache->flush();
+
+    // Descriptors and images, hashed in log order
+    std::vector<char> log((length - 1) * Disk::BLOCK_SIZE);
+    uint64_t hash = CHECKSUM_SEED;
+    char    *next = log.data();
+    for (size_t i = 0; i < count; ) {
+    	size_t batch = count - i < DESCRIPTOR_BLOCKS ? count - i : DESCRIPTOR_BLOCKS;
+    	memset(next, 0, Disk::BLOCK_SIZE);
+    	Descriptor *descriptor  = (Descriptor *)next;
+    	descriptor->MagicNumber = MAGIC_NUMBER;
+    	descriptor->Type	= DESCRIPTOR;
+    	descriptor->Sequence	= Sequence;
+    	descriptor->Count	= batch;
+    	for (size_t j = 0; j < batch; j++) {
+    	    descriptor->Blocks[j] = blocks[i + j];
+	}
+    	hash  = checksum(hash, next);
+    	next += Disk::BLOCK_SIZE;
+    	for (size_t j = 0; j < batch; j++, i++) {
+    	    memcpy(next, images.data() + i * Disk::BLOCK_SIZE, Disk::BLOCK_SIZE);
+    	    hash  = checksum(hash, next);
+    	    next += Disk::BLOCK_SIZE;
+	}
+    }
+    transfer_log(Head, length - 1, log.data(), true);
+    disk->sync();
+
+    // The transaction counts once its commit block is durable
+    char block[Disk::BLOCK_SIZE];
+    memset(block, 0, Disk::BLOCK_SIZE);
+    Commit *commit	= (Commit *)block;
+    commit->MagicNumber = MAGIC_NUMBER;
+    commit->Type	= COMMIT;
+    commit->Sequence	= Sequence;
+    commit->Count	= count;
+    commit->Checksum	= hash;
+    transfer_log(Head + length - 1, 1, block, true);
+    disk->sync();
+
+    Head += length;
+    Sequence++;
+    Commits++;
+    Logged += count;
+    cache->release();
+}
+
+void Journal::checkpoint() {
+    // Committed blocks that are not held go in place through the cache. A held
+    // block has changed again since, so its last logged image goes in place
+    // instead (the cache never writes back a held block, so nothing races it)
+    cache->flush();
+
+    // Walk the live transactions, the oldest first, for the last image of each block
+    std::unordered_map<uint64_t, uint64_t> latest;
+    std::vector<uint64_t> blocks;
+    std::vector<uint64_t> positions;
+    uint64_t position = Tail;
+    uint64_t sequence = TailSequence;
+    size_t   length;
+    while (position < Head && (length = read_transaction(position, sequence, blocks, positions)) > 0) {
+    	for (size_t i = 0; i < blocks.size(); i++) {
+    	    latest[blocks[i]] = positions[i];
+	}
+    	position += length;
+    	sequence++;
+    }
+
+    char block[Disk::BLOCK_SIZE];
+    std::unordered_map<uint64_t, uint64_t>::iterator it = latest.begin();
+    for (; it != latest.end(); it++) {
+    	if (cache->held(it->first)) {
+    	    transfer_log(it->second, 1, block, false);
+    	    disk->write(it->first, block);
+	}
+    }
+
+    disk->sync();
+    Tail	 = Head;
+    TailSequence = Sequence;
+    write_header();
+    disk->sync();
+    Checkpoints++;
+}
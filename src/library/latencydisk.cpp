@@ -0,0 +1,57 @@
+// latencydisk.cpp: disk with the service times of a real device
+
+#include "sfs/latencydisk.h"
+
+#include <thread>
+
+const LatencyDisk::Latency LatencyDisk::SSD = {"ssd", 20000, 0, 1000, 100000};
+const LatencyDisk::Latency LatencyDisk::HDD = {"hdd", 100000, 8000000, 25000, 10000000};
+
+LatencyDisk::LatencyDisk(Disk *inner, const Latency &latency)
+    : Inner(inner), Model(latency), BusyUntil(std::chrono::steady_clock::now()), Position(0) {
+    Inner->Wrapped = true;
+    Blocks = Inner->size();
+}
+
+LatencyDisk::~LatencyDisk() {
+    delete Inner;
+}
+
+void LatencyDisk::serve(size_t blocknum, size_t count) {
+    uint64_t service = count ? Model.RequestNs + count*Model.BlockNs : Model.SyncNs;
+
+    std::chrono::steady_clock::time_point done;
+    {
+    	std::lock_guard<std::mutex> lock(Lock);
+    	if (count && blocknum != Position) {
+    	    service += Model.SeekNs;
+	}
+    	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    	done	  = (BusyUntil > now ? BusyUntil : now) + std::chrono::nanoseconds(service);
+    	BusyUntil = done;
+    	if (count) {
+    	    Position = blocknum + count;
+	}
+    }
+    std::this_thread::sleep_until(done);
+}
+
+void LatencyDisk::transfer_blocks(size_t blocknum, size_t count, char *data, bool write) {
+    serve(blocknum, count);
+    Inner->transfer_blocks(blocknum, count, data, write);
+}
+
+void LatencyDisk::transfer_vector(size_t blocknum, size_t count, char **buffers, bool write) {
+    serve(blocknum, count);
+    Inner->transfer_vector(blocknum, count, buffers, write);
+}
+
+bool LatencyDisk::discard(size_t blocknum, size_t count) {
+    sanity_check_run(blocknum, count);
+    return Inner->discard(blocknum, count);
+}
+
+void LatencyDisk::sync() {
+    Inner->sync();
+    serve(0, 0);
+}
@@ -0,0 +1,132 @@
+// ramdisk.cpp: disk kept in memory
+
+#include "sfs/ramdisk.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+void RamDisk::open(const char *path, size_t nblocks) {
+    // calloc maps fresh zero pages, so blocks never written cost no memory
+    Memory = (char *)calloc(nblocks ? nblocks : 1, BLOCK_SIZE);
+    if (Memory == NULL) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to allocate %lu blocks", nblocks);
+    	throw std::runtime_error(what);
+    }
+    std::vector<std::atomic<bool>>(nblocks).swap(Dirty);
+
+    if (path != NULL) {
+    	int fd = ::open(path, O_RDONLY);
+    	if (fd < 0 && errno != ENOENT) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    	for (size_t done = 0; fd >= 0 && done < nblocks*BLOCK_SIZE; ) {
+    	    ssize_t n = pread(fd, Memory + done, nblocks*BLOCK_SIZE - done, done);
+    	    if (n < 0 && errno == EINTR) {
+    	    	continue;
+	    }
+    	    if (n < 0) {
+    	    	char what[BUFSIZ];
+    	    	snprintf(what, BUFSIZ, "Unable to load %s: %s", path, strerror(errno));
+    	    	close(fd);
+    	    	throw std::runtime_error(what);
+	    }
+    	    if (n == 0) {
+    	    	break;
+	    }
+    	    done += n;
+	}
+    	if (fd >= 0) {
+    	    close(fd);
+	}
+    	Path = path;
+    }
+
+    Blocks = nblocks;
+}
+
+RamDisk::~RamDisk() {
+    if (Memory) {
+    	if (!Path.empty() && !store()) {
+    	    fprintf(stderr, "Unable to store %s: %s\n", Path.c_str(), strerror(errno));
+	}
+    	free(Memory);
+    	Memory = NULL;
+    }
+}
+
+bool RamDisk::store() {
+    int fd = ::open(Path.c_str(), O_WRONLY|O_CREAT, 0600);
+    if (fd < 0) {
+    	return false;
+    }
+
+    bool ok = ftruncate(fd, (off_t)Blocks*BLOCK_SIZE) == 0;
+    for (size_t blocknum = 0; ok && blocknum < Blocks; ) {
+    	if (!Dirty[blocknum]) {
+    	    blocknum++;
+    	    continue;
+	}
+
+    	// One write per run of written blocks
+    	size_t count = 1;
+    	while (blocknum + count < Blocks && Dirty[blocknum + count]) {
+    	    count++;
+	}
+    	off_t offset = (off_t)blocknum*BLOCK_SIZE;
+    	off_t end    = (off_t)(blocknum + count)*BLOCK_SIZE;
+    	while (offset < end) {
+    	    ssize_t n = pwrite(fd, Memory + offset, end - offset, offset);
+    	    if (n < 0 && errno == EINTR) {
+    	    	continue;
+	    }
+    	    if (n <= 0) {
+    	    	if (n == 0) {
+    	    	    errno = EIO;
+		}
+    	    	ok = false;
+    	    	break;
+	    }
+    	    offset += n;
+	}
+    	blocknum += count;
+    }
+
+    int saved = errno;
+    if (close(fd) < 0 && ok) {
+    	return false;
+    }
+    errno = saved;
+    return ok;
+}
+
+void RamDisk::transfer_blocks(size_t blocknum, size_t count, char *data, bool write) {
+    char *blocks = Memory + (off_t)blocknum*BLOCK_SIZE;
+    if (write) {
+    	memcpy(blocks, data, count*BLOCK_SIZE);
+    	for (size_t i = 0; i < count; i++) {
+    	    Dirty[blocknum + i].store(true, std::memory_order_relaxed);
+	}
+    } else {
+    	memcpy(data, blocks, count*BLOCK_SIZE);
+    }
+}
+
+const char *RamDisk::map_block(size_t blocknum) {
+    return Memory + (off_t)blocknum*BLOCK_SIZE;
+}
+
+bool RamDisk::discard(size_t blocknum, size_t count) {
+    sanity_check_run(blocknum, count);
+    memset(Memory + (off_t)blocknum*BLOCK_SIZE, 0, count*BLOCK_SIZE);
+    for (size_t i = 0; i < count; i++) {
+    	Dirty[blocknum + i].store(true, std::memory_order_relaxed);
+    }
+    return true;
+}
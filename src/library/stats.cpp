@@ -0,0 +1,156 @@
+// stats.cpp: operation counters and latency histograms
+
+#include "sfs/stats.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <string.h>
+
+// Counters of one thread, only ever written by that thread
+struct Slot {
+    std::atomic<uint64_t> Count[Stats::OPS];
+    std::atomic<uint64_t> Nanoseconds[Stats::OPS];
+    std::atomic<uint64_t> Bytes[Stats::OPS];
+    std::atomic<uint64_t> Buckets[Stats::OPS][Stats::BUCKETS];
+
+    Slot();
+    ~Slot();
+};
+
+// Every live slot plus what exited threads and resets left behind (never freed,
+// so threads exiting during process teardown can still retire their slots)
+struct Registry {
+    std::mutex	      Lock;
+    std::vector<Slot *> Slots;
+    Stats::Snapshot   Retired;	    // Counters of threads that have exited
+    Stats::Snapshot   Baseline;	    // Totals at the last reset
+
+    Registry() {
+    	memset(&Retired, 0, sizeof(Retired));
+    	memset(&Baseline, 0, sizeof(Baseline));
+    }
+};
+
+static Registry *registry() {
+    static Registry *instance = new Registry();
+    return instance;
+}
+
+static thread_local Slot LocalSlot;
+
+// Add a counter read from a slot to a snapshot counter
+static void add_slot(const Slot *slot, size_t op, Stats::Counter *counter) {
+    counter->Count	 += slot->Count[op].load(std::memory_order_relaxed);
+    counter->Nanoseconds += slot->Nanoseconds[op].load(std::memory_order_relaxed);
+    counter->Bytes	 += slot->Bytes[op].load(std::memory_order_relaxed);
+    for (size_t b = 0; b < Stats::BUCKETS; b++) {
+    	counter->Buckets[b] += slot->Buckets[op][b].load(std::memory_order_relaxed);
+    }
+}
+
+// Bump a counter owned by the calling thread without a locked instruction
+static inline void bump(std::atomic<uint64_t> &value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+Slot::Slot() {
+    for (size_t op = 0; op < Stats::OPS; op++) {
+    	Count[op] = Nanoseconds[op] = Bytes[op] = 0;
+    	for (size_t b = 0; b < Stats::BUCKETS; b++) {
+    	    Buckets[op][b] = 0;
+	}
+    }
+
+    Registry *r = registry();
+    std::lock_guard<std::mutex> lock(r->Lock);
+    r->Slots.push_back(this);
+}
+
+Slot::~Slot() {
+    Registry *r = registry();
+    std::lock_guard<std::mutex> lock(r->Lock);
+    for (size_t op = 0; op < Stats::OPS; op++) {
+    	add_slot(this, op, &r->Retired.Ops[op]);
+    }
+    for (size_t i = 0; i < r->Slots.size(); i++) {
+    	if (r->Slots[i] == this) {
+    	    r->Slots.erase(r->Slots.begin() + i);
+    	    break;
+	}
+    }
+}
+
+void Stats::record(Op op, uint64_t nanoseconds) {
+    size_t bucket = nanoseconds ? 64 - __builtin_clzll(nanoseconds) : 0;
+    if (bucket >= BUCKETS) {
+    	bucket = BUCKETS - 1;
+    }
+
+    Slot &slot = LocalSlot;
+    bump(slot.Count[op], 1);
+    bump(slot.Nanoseconds[op], nanoseconds);
+    bump(slot.Buckets[op][bucket], 1);
+}
+
+void Stats::transferred(Op op, uint64_t bytes) {
+    bump(LocalSlot.Bytes[op], bytes);
+}
+
+// Totals since the process started
+static void totals(Registry *r, Stats::Snapshot *snapshot) {
+    *snapshot = r->Retired;
+    for (size_t i = 0; i < r->Slots.size(); i++) {
+    	for (size_t op = 0; op < Stats::OPS; op++) {
+    	    add_slot(r->Slots[i], op, &snapshot->Ops[op]);
+	}
+    }
+}
+
+void Stats::snapshot(Snapshot *snapshot) {
+    Registry *r = registry();
+    std::lock_guard<std::mutex> lock(r->Lock);
+    totals(r, snapshot);
+    for (size_t op = 0; op < OPS; op++) {
+    	Counter &counter = snapshot->Ops[op];
+    	const Counter &base = r->Baseline.Ops[op];
+    	counter.Count	    -= base.Count;
+    	counter.Nanoseconds -= base.Nanoseconds;
+    	counter.Bytes	    -= base.Bytes;
+    	for (size_t b = 0; b < BUCKETS; b++) {
+    	    counter.Buckets[b] -= base.Buckets[b];
+	}
+    }
+}
+
+void Stats::reset() {
+    Registry *r = registry();
+    std::lock_guard<std::mutex> lock(r->Lock);
+    totals(r, &r->Baseline);
+}
+
+const char *Stats::name(Op op) {
+    static const char *names[OPS] = {"create", "remove", "stat", "read", "write", "mount", "disk_read", "disk_write"};
+    return op < OPS ? names[op] : "unknown";
+}
+
+uint64_t Stats::percentile(const Counter &counter, double percentile) {
+    if (counter.Count == 0) {
+    	return 0;
+    }
+
+    // Smallest bucket holding the rank of the percentile
+    uint64_t rank = (uint64_t)(counter.Count * percentile / 100);
+    if (rank >= counter.Count) {
+    	rank = counter.Count - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < BUCKETS; b++) {
+    	seen += counter.Buckets[b];
+    	if (seen > rank) {
+    	    return 1ULL << b;
+	}
+    }
+    return 1ULL << (BUCKETS - 1);
+}
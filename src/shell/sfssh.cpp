@@ -2,7 +2,11 @@
 
 #include "sfs/disk.h"
 #include "sfs/fs.h"
+#include "sfs/stats.h"
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <stdexcept>
@@ -10,6 +14,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Macros
 
@@ -20,12 +25,14 @@
 void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_unmount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_stats(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path);
@@ -34,20 +41,25 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber);
 // Main execution
 
 int main(int argc, char *argv[]) {
-    Disk	disk;
-    FileSystem	fs;
-
-    if (argc != 3) {
-    	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    if (argc < 3 || argc > 5) {
+    	fprintf(stderr, "Usage: %s <diskfile> <nblocks> [file|mmap|async|ram|ssd|hdd] [cacheblocks]\n", argv[0]);
     	return EXIT_FAILURE;
     }
 
+    size_t cacheBlocks = argc == 5 ? strtoull(argv[4], NULL, 10) : BlockCache::DEFAULT_CAPACITY;
+    std::unique_ptr<Disk> disk;
+    FileSystem fs(cacheBlocks);
+
     try {
-    	disk.open(argv[1], atoi(argv[2]));
+    	disk.reset(Disk::create(argc >= 4 ? argv[3] : "file", argv[1], strtoull(argv[2], NULL, 10)));
     } catch (std::runtime_error &e) {
     	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
     	return EXIT_FAILURE;
     }
+    if (!disk) {
+    	fprintf(stderr, "Unknown disk backend: %s\n", argv[3]);
+    	return EXIT_FAILURE;
+    }
 
     while (true) {
 	char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
@@ -65,25 +77,29 @@ int main(int argc, char *argv[]) {
 	}
 
 	if (streq(cmd, "debug")) {
-	    do_debug(disk, fs, args, arg1, arg2);
+	    do_debug(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "format")) {
-	    do_format(disk, fs, args, arg1, arg2);
+	    do_format(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "mount")) {
-	    do_mount(disk, fs, args, arg1, arg2);
+	    do_mount(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "unmount")) {
+	    do_unmount(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "cat")) {
-	    do_cat(disk, fs, args, arg1, arg2);
+	    do_cat(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyout")) {
-	    do_copyout(disk, fs, args, arg1, arg2);
+	    do_copyout(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "create")) {
-	    do_create(disk, fs, args, arg1, arg2);
+	    do_create(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "remove")) {
-	    do_remove(disk, fs, args, arg1, arg2);
+	    do_remove(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "stat")) {
-	    do_stat(disk, fs, args, arg1, arg2);
+	    do_stat(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyin")) {
-	    do_copyin(disk, fs, args, arg1, arg2);
+	    do_copyin(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "stats")) {
+	    do_stats(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "help")) {
-	    do_help(disk, fs, args, arg1, arg2);
+	    do_help(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "exit") || streq(cmd, "quit")) {
 	    break;
 	} else {
@@ -103,16 +119,41 @@ void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     	return;
     }
 
+    fs.sync();
     fs.debug(&disk);
 }
 
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-    	printf("Usage: format\n");
-    	return;
+    bool lazy = false;
+    uint32_t version = FileSystem::EXTENT_VERSION;
+    FileSystem::FormatOptions geometry = FileSystem::FormatOptions();
+    char *arguments[] = {arg1, arg2};
+    for (int i = 0; i < args - 1; i++) {
+    	// Options may also be joined with commas, as in lazy,inline
+    	char *saveptr = NULL;
+    	for (char *option = strtok_r(arguments[i], ",", &saveptr); option; option = strtok_r(NULL, ",", &saveptr)) {
+    	    char *value = strchr(option, '=');
+    	    uint64_t number = value ? strtoull(value + 1, NULL, 10) : 0;
+    	    if (streq(option, "lazy")) {
+    	    	lazy = true;
+	    } else if (streq(option, "64")) {
+    	    	version = FileSystem::EXTENT64_VERSION;
+	    } else if (streq(option, "inline")) {
+    	    	version = FileSystem::INLINE_VERSION;
+	    } else if (value && number && strncmp(option, "inodes=", value - option + 1) == 0) {
+    	    	geometry.Inodes = number;
+	    } else if (value && number && strncmp(option, "bytes-per-inode=", value - option + 1) == 0) {
+    	    	geometry.BytesPerInode = number;
+	    } else if (value && strncmp(option, "reserved=", value - option + 1) == 0) {
+    	    	geometry.ReservedBlocks = number;
+	    } else {
+    	    	printf("Usage: format [lazy] [64|inline] [inodes=N|bytes-per-inode=N] [reserved=N]\n");
+    	    	return;
+	    }
+	}
     }
 
-    if (fs.format(&disk)) {
+    if (fs.format(&disk, lazy, version, geometry)) {
     	printf("disk formatted.\n");
     } else {
     	printf("format failed!\n");
@@ -125,13 +166,32 @@ void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     	return;
     }
 
-    if (fs.mount(&disk)) {
+    // Wall time goes to stderr so that the output stays comparable
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool mounted = fs.mount(&disk);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    fprintf(stderr, "mount took %.3f ms\n", elapsed.count());
+
+    if (mounted) {
     	printf("disk mounted.\n");
     } else {
     	printf("mount failed!\n");
     }
 }
 
+void do_unmount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: unmount\n");
+    	return;
+    }
+
+    if (fs.unmount()) {
+    	printf("disk unmounted.\n");
+    } else {
+    	printf("unmount failed!\n");
+    }
+}
+
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
     	printf("Usage: cat <inode>\n");
@@ -208,10 +268,72 @@ void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_stats(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    bool json = args == 2 && streq(arg1, "json");
+    if (args > 2 || (args == 2 && !json && !streq(arg1, "reset"))) {
+    	printf("Usage: stats [reset|json]\n");
+    	return;
+    }
+
+    if (args == 2 && !json) {
+    	fs.reset_stats();
+    	printf("stats reset.\n");
+    	return;
+    }
+
+    Stats::Snapshot snapshot;
+    Stats::snapshot(&snapshot);
+    const BlockCache *cache = fs.block_cache();
+    FileSystem::AllocatorStats alloc = fs.allocator_stats();
+
+    if (json) {
+    	printf("{\"operations\": {");
+    	for (size_t op = 0; op < Stats::OPS; op++) {
+    	    const Stats::Counter &c = snapshot.Ops[op];
+    	    printf("%s\n  \"%s\": {\"count\": %lu, \"bytes\": %lu, \"nanoseconds\": %lu, \"p50_ns\": %lu, \"p99_ns\": %lu, \"histogram\": [",
+    	    	   op ? "," : "", Stats::name((Stats::Op)op), c.Count, c.Bytes, c.Nanoseconds,
+    	    	   Stats::percentile(c, 50), Stats::percentile(c, 99));
+    	    for (size_t b = 0; b < Stats::BUCKETS; b++) {
+    	    	printf("%s%lu", b ? ", " : "", c.Buckets[b]);
+	    }
+    	    printf("]}");
+	}
+    	printf("\n}");
+    	if (cache) {
+    	    printf(",\n\"cache\": {\"hits\": %lu, \"misses\": %lu, \"evictions\": %lu, \"writebacks\": %lu, "
+    	    	   "\"readahead_blocks\": %lu, \"readahead_hits\": %lu, \"readahead_wasted\": %lu}",
+    	    	   cache->hits(), cache->misses(), cache->evictions(), cache->writebacks(),
+    	    	   cache->prefetches(), cache->readahead_hits(), cache->readahead_wasted());
+    	    printf(",\n\"allocator\": {\"extents\": %lu, \"blocks\": %lu, \"freed\": %lu, \"failures\": %lu, \"free_blocks\": %lu}",
+    	    	   alloc.Extents, alloc.Blocks, alloc.Freed, alloc.Failures, fs.free_blocks());
+	}
+    	printf("}\n");
+    	return;
+    }
+
+    // Latencies are upper bounds of power-of-two histogram buckets
+    printf("%-10s %8s %12s %10s %10s %10s\n", "operation", "count", "bytes", "avg us", "p50 us", "p99 us");
+    for (size_t op = 0; op < Stats::OPS; op++) {
+    	const Stats::Counter &c = snapshot.Ops[op];
+    	printf("%-10s %8lu %12lu %10.1f %10.1f %10.1f\n", Stats::name((Stats::Op)op), c.Count, c.Bytes,
+    	       c.Count ? c.Nanoseconds / 1000.0 / c.Count : 0.0,
+    	       Stats::percentile(c, 50) / 1000.0, Stats::percentile(c, 99) / 1000.0);
+    }
+    if (cache) {
+    	printf("cache: %lu hits, %lu misses, %lu evictions, %lu writebacks\n",
+    	       cache->hits(), cache->misses(), cache->evictions(), cache->writebacks());
+    	printf("readahead: %lu blocks, %lu hits, %lu wasted\n",
+    	       cache->prefetches(), cache->readahead_hits(), cache->readahead_wasted());
+    	printf("allocator: %lu extents, %lu blocks allocated, %lu blocks freed, %lu failures, %lu free blocks\n",
+    	       alloc.Extents, alloc.Blocks, alloc.Freed, alloc.Failures, fs.free_blocks());
+    }
+}
+
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
+    printf("    format  [lazy] [64|inline] [inodes=N|bytes-per-inode=N] [reserved=N]\n");
     printf("    mount\n");
+    printf("    unmount\n");
     printf("    debug\n");
     printf("    create\n");
     printf("    remove  <inode>\n");
@@ -219,6 +341,7 @@ void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("    stat    <inode>\n");
     printf("    copyin  <file> <inode>\n");
     printf("    copyout <inode> <file>\n");
+    printf("    stats   [reset|json]\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
@@ -231,15 +354,52 @@ bool copyout(FileSystem &fs, size_t inumber, const char *path) {
     	return false;
     }
 
+    // Holes are skipped in output that can seek and written as zeros otherwise
+    static const char zeros[4*BUFSIZ] = {0};
+    bool seekable = fseek(stream, 0, SEEK_CUR) == 0;
+
     char buffer[4*BUFSIZ] = {0};
     size_t offset = 0;
-    while (true) {
-    	ssize_t result = fs.read(inumber, buffer, sizeof(buffer), offset);
-    	if (result <= 0) {
+    ssize_t handle = fs.open(inumber);
+    size_t size = handle >= 0 ? fs.stat(inumber) : 0;
+    while (offset < size) {
+    	ssize_t data = fs.seek(handle, offset, SEEK_DATA);
+    	size_t end = data < 0 ? size : data;
+    	if (seekable) {
+    	    fseek(stream, end, SEEK_SET);
+    	    offset = end;
+	}
+    	for (; offset < end; offset += std::min(end - offset, sizeof(zeros))) {
+    	    fwrite(zeros, 1, std::min(end - offset, sizeof(zeros)), stream);
+	}
+    	if (data < 0) {
     	    break;
 	}
-	fwrite(buffer, 1, result, stream);
-	offset += result;
+
+    	size_t hole = fs.seek(handle, offset, SEEK_HOLE);
+    	fs.seek(handle, offset);
+    	while (offset < hole) {
+    	    ssize_t result = fs.read(handle, buffer, std::min(hole - offset, sizeof(buffer)));
+    	    if (result <= 0) {
+    	    	break;
+	    }
+	    fwrite(buffer, 1, result, stream);
+	    offset += result;
+	}
+    	if (offset < hole) {
+    	    break;
+	}
+    }
+    if (handle >= 0) {
+    	fs.close(handle);
+    }
+
+    // A trailing hole is left by growing the output to the full size
+    if (seekable && offset > 0) {
+    	fflush(stream);
+    	if (ftruncate(fileno(stream), offset) < 0) {
+    	    fprintf(stderr, "Unable to resize %s: %s\n", path, strerror(errno));
+	}
     }
 
     printf("%lu bytes copied\n", offset);
@@ -247,6 +407,49 @@ bool copyout(FileSystem &fs, size_t inumber, const char *path) {
     return true;
 }
 
+// Whether the zero block at position can be seeked over: it lies past the end of the file or in a
+// hole, so it reads back as zeros without being written (leaves the handle at position)
+static bool skip_zeros(FileSystem &fs, size_t handle, size_t position) {
+    ssize_t hole = fs.seek(handle, position, SEEK_HOLE);
+    fs.seek(handle, position);
+    return hole < 0 || (size_t)hole == position;
+}
+
+// Write data at the handle's position, seeking over whole zero blocks that need no write instead of
+// writing them
+static ssize_t write_sparse(FileSystem &fs, size_t handle, char *data, size_t length, size_t offset) {
+    static const char zeros[Disk::BLOCK_SIZE] = {0};
+    size_t done = 0;
+    while (done < length) {
+    	// Gather blocks up to the next zero block to skip (a short last block is always written)
+    	size_t run = 0;
+    	while (done + run < length) {
+    	    size_t left = length - done - run;
+    	    if (left >= Disk::BLOCK_SIZE && memcmp(data + done + run, zeros, Disk::BLOCK_SIZE) == 0 &&
+    	    	skip_zeros(fs, handle, offset + done + run)) {
+    	    	break;
+	    }
+    	    run += left < Disk::BLOCK_SIZE ? left : Disk::BLOCK_SIZE;
+	}
+    	if (run > 0) {
+    	    fs.seek(handle, offset + done);
+    	    ssize_t actual = fs.write(handle, data + done, run);
+    	    if (actual < 0) {
+    	    	return done ? (ssize_t)done : -1;
+	    }
+    	    done += actual;
+    	    if ((size_t)actual != run) {
+    	    	return done;
+	    }
+    	    continue;
+	}
+
+    	done += Disk::BLOCK_SIZE;
+    	fs.seek(handle, offset + done);
+    }
+    return done;
+}
+
 bool copyin(FileSystem &fs, const char *path, size_t inumber) {
     FILE *stream = fopen(path, "r");
     if (stream == nullptr) {
@@ -256,13 +459,14 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
 
     char buffer[4*BUFSIZ] = {0};
     size_t offset = 0;
+    ssize_t handle = fs.open(inumber);
     while (true) {
     	ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
     	if (result <= 0) {
     	    break;
 	}
 
-	ssize_t actual = fs.write(inumber, buffer, result, offset);
+	ssize_t actual = handle >= 0 ? write_sparse(fs, handle, buffer, result, offset) : -1;
 	if (actual < 0) {
 	    fprintf(stderr, "fs.write returned invalid result %ld\n", actual);
 	    break;
@@ -273,6 +477,14 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
 	    break;
 	}
     }
+    if (handle >= 0) {
+    	// The file ends where the copy does: a trailing hole extends it, data of a larger file it
+    	// replaces is cut off
+    	if (!fs.truncate(inumber, offset)) {
+    	    fprintf(stderr, "fs.truncate could not set the size to %lu bytes\n", offset);
+	}
+    	fs.close(handle);
+    }
 
     printf("%lu bytes copied\n", offset);
     fclose(stream);
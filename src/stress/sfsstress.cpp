@@ -0,0 +1,208 @@
+// sfsstress.cpp: Multi-threaded file system stress test
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Macros
+
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+// Constants
+
+const size_t MAX_FILE_SIZE = 1 << 20;	// Largest file used by the test
+const size_t READ_CHUNK	   = 64 * 1024;	// Bytes per read (whole blocks)
+const size_t WRITE_CHUNK   = 12000;	// Bytes per write (not block aligned)
+const size_t ROUNDS	   = 4;		// Passes over the files per thread
+
+// Shared state
+
+std::atomic<size_t> Errors(0);
+
+// Pattern byte stored at offset of inumber
+static char pattern(size_t inumber, size_t offset) {
+    return (char)((inumber * 131 + offset / 7) & 0xff);
+}
+
+static void fill(char *data, size_t inumber, size_t offset, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+    	data[i] = pattern(inumber, offset + i);
+    }
+}
+
+static bool check(const char *data, size_t inumber, size_t offset, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+    	if (data[i] != pattern(inumber, offset + i)) {
+    	    return false;
+	}
+    }
+    return true;
+}
+
+// Read every file ROUNDS times, starting at a different file per thread
+static void reader(FileSystem *fs, const std::vector<size_t> *files, size_t id, size_t fileSize, size_t *bytes) {
+    std::vector<char> buffer(READ_CHUNK);
+    for (size_t round = 0; round < ROUNDS * files->size(); round++) {
+    	size_t inumber = (*files)[(id + round) % files->size()];
+    	for (size_t offset = 0; offset < fileSize; offset += READ_CHUNK) {
+    	    ssize_t result = fs->read(inumber, &buffer[0], READ_CHUNK, offset);
+    	    if (result <= 0 || !check(&buffer[0], inumber, offset, result)) {
+    	    	fprintf(stderr, "read of inode %lu at %lu failed\n", inumber, offset);
+    	    	Errors++;
+    	    	return;
+	    }
+    	    *bytes += result;
+	}
+    }
+}
+
+// Rewrite this thread's own file through a handle, and churn a scratch inode
+static void writer(FileSystem *fs, size_t inumber, size_t fileSize, size_t *bytes) {
+    std::vector<char> buffer(WRITE_CHUNK);
+    for (size_t round = 0; round < ROUNDS; round++) {
+    	ssize_t handle = fs->open(inumber);
+    	if (handle < 0) {
+    	    fprintf(stderr, "open of inode %lu failed\n", inumber);
+    	    Errors++;
+    	    return;
+	}
+    	for (size_t offset = 0; offset < fileSize; offset += WRITE_CHUNK) {
+    	    size_t length = fileSize - offset < WRITE_CHUNK ? fileSize - offset : WRITE_CHUNK;
+    	    fill(&buffer[0], inumber, offset, length);
+    	    if (fs->write(handle, &buffer[0], length) != (ssize_t)length) {
+    	    	fprintf(stderr, "write of inode %lu at %lu failed\n", inumber, offset);
+    	    	Errors++;
+    	    	break;
+	    }
+    	    *bytes += length;
+	}
+    	fs->close(handle);
+
+    	ssize_t scratch = fs->create();
+    	if (scratch < 0 || fs->write(scratch, &buffer[0], WRITE_CHUNK, 0) != (ssize_t)WRITE_CHUNK || !fs->remove(scratch)) {
+    	    fprintf(stderr, "create/remove churn failed\n");
+    	    Errors++;
+	}
+    }
+}
+
+// Run one thread per slot and return elapsed seconds and total bytes
+template <typename Function>
+static double run(size_t threads, Function function, size_t *total) {
+    std::vector<std::thread> workers;
+    std::vector<size_t> bytes(threads, 0);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t id = 0; id < threads; id++) {
+    	workers.push_back(std::thread(function, id, &bytes[id]));
+    }
+    for (size_t id = 0; id < threads; id++) {
+    	workers[id].join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    *total = 0;
+    for (size_t id = 0; id < threads; id++) {
+    	*total += bytes[id];
+    }
+    return elapsed.count();
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || argc > 6) {
+    	fprintf(stderr, "Usage: %s <diskfile> <nblocks> <threads> [file|mmap|async|ram|ssd|hdd] [cacheblocks]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    size_t cacheBlocks = argc == 6 ? strtoull(argv[5], NULL, 10) : BlockCache::DEFAULT_CAPACITY;
+    std::unique_ptr<Disk> disk;
+    FileSystem fs(cacheBlocks);
+
+    size_t maxThreads = atoi(argv[3]);
+    if (maxThreads == 0) {
+    	fprintf(stderr, "Need at least one thread\n");
+    	return EXIT_FAILURE;
+    }
+
+    try {
+    	disk.reset(Disk::create(argc >= 5 ? argv[4] : "file", argv[1], strtoull(argv[2], NULL, 10)));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+    	return EXIT_FAILURE;
+    }
+    if (!disk) {
+    	fprintf(stderr, "Unknown disk backend: %s\n", argv[4]);
+    	return EXIT_FAILURE;
+    }
+
+    if (!FileSystem::format(disk.get()) || !fs.mount(disk.get())) {
+    	fprintf(stderr, "Unable to format and mount %s\n", argv[1]);
+    	return EXIT_FAILURE;
+    }
+
+    // One file per thread, sized so that all of them fit with room to spare
+    size_t fileSize = fs.free_blocks() / (2 * maxThreads + 2) * Disk::BLOCK_SIZE;
+    if (fileSize > MAX_FILE_SIZE) {
+    	fileSize = MAX_FILE_SIZE;
+    }
+    if (fileSize < WRITE_CHUNK) {
+    	fprintf(stderr, "Disk is too small for %lu threads\n", maxThreads);
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<size_t> files;
+    std::vector<char> buffer(fileSize);
+    for (size_t id = 0; id < maxThreads; id++) {
+    	ssize_t inumber = fs.create();
+    	if (inumber < 0) {
+    	    fprintf(stderr, "Unable to create file %lu\n", id);
+    	    return EXIT_FAILURE;
+	}
+    	fill(&buffer[0], inumber, 0, fileSize);
+    	if (fs.write(inumber, &buffer[0], fileSize, 0) != (ssize_t)fileSize) {
+    	    fprintf(stderr, "Unable to write file %lu\n", id);
+    	    return EXIT_FAILURE;
+	}
+    	files.push_back(inumber);
+    }
+
+    printf("%lu files of %lu bytes\n", files.size(), fileSize);
+    printf("threads  read MB/s  write MB/s\n");
+    for (size_t threads = 1; threads <= maxThreads && Errors == 0; threads++) {
+    	size_t readBytes, writeBytes;
+    	double readTime = run(threads, [&](size_t id, size_t *bytes) {
+    	    reader(&fs, &files, id, fileSize, bytes);
+	}, &readBytes);
+    	double writeTime = run(threads, [&](size_t id, size_t *bytes) {
+    	    writer(&fs, files[id], fileSize, bytes);
+	}, &writeBytes);
+    	printf("%7lu  %9.1f  %10.1f\n", threads, readBytes / readTime / (1 << 20), writeBytes / writeTime / (1 << 20));
+    }
+
+    // Everything must still be intact once written back
+    fs.sync();
+    for (size_t i = 0; i < files.size() && Errors == 0; i++) {
+    	if (fs.read(files[i], &buffer[0], fileSize, 0) != (ssize_t)fileSize || !check(&buffer[0], files[i], 0, fileSize)) {
+    	    fprintf(stderr, "file %lu is corrupt\n", files[i]);
+    	    Errors++;
+	}
+    }
+
+    if (Errors > 0) {
+    	fprintf(stderr, "%lu errors\n", Errors.load());
+    	return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
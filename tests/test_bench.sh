@@ -0,0 +1,25 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: every workload reports one record in each format
+
+echo -n "Testing bench with csv report ... "
+if ./bin/sfsbench $SCRATCH/image.4096 4096 csv > $SCRATCH/bench.csv 2> /dev/null &&
+   [ $(grep -c '^[a-z]*,[0-9]*,[1-9][0-9]*,' $SCRATCH/bench.csv) -eq 15 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/bench.csv
+fi
+
+echo -n "Testing bench with json report ... "
+if ./bin/sfsbench $SCRATCH/image.4096 4096 json > $SCRATCH/bench.json 2> /dev/null &&
+   [ $(grep -c '"workload": ' $SCRATCH/bench.json) -eq 15 ] &&
+   [ "$(head -n 1 $SCRATCH/bench.json)" = "[" ] && [ "$(tail -n 1 $SCRATCH/bench.json)" = "]" ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/bench.json
+fi
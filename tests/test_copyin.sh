@@ -75,3 +75,196 @@ if [ $(md5sum $SCRATCH/1.copy | awk '{print $1}') = '0af623d6d8cb0a514816e17c738
 else
     echo "Failure"
 fi
+
+# Test: a file written into scattered free blocks spills its extents into an extent block
+
+fragmented-debug-output() {
+    cat <<EOF
+Inode 0:
+    size: 28893 bytes
+    extents: 17-18 3-3 5-5 9-9 11-11 13-13 15-15
+    extent blocks: 7
+EOF
+}
+
+rm -f $SCRATCH/image.20
+seq 1 6000 > $SCRATCH/seq.txt
+head -c 4096 $SCRATCH/seq.txt > $SCRATCH/block.txt
+{
+    echo format
+    echo mount
+    for i in $(seq 0 13); do echo create; echo "copyin $SCRATCH/block.txt $i"; done
+    for i in $(seq 0 2 12); do echo "remove $i"; done
+    echo create
+    echo "copyin $SCRATCH/seq.txt 0"
+    echo unmount
+} | ./bin/sfssh $SCRATCH/image.20 20 > /dev/null 2>&1
+printf "mount\ncopyout 0 $SCRATCH/seq.copy\n" | ./bin/sfssh $SCRATCH/image.20 20 > /dev/null 2>&1
+echo -n "Testing copyin with extent blocks in $SCRATCH/image.20 ... "
+if diff -u <(echo debug | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null | grep -A 3 '^Inode 0:') <(fragmented-debug-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/seq.txt $SCRATCH/seq.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: buffered writes stop at the blocks that can be reserved on a full disk
+
+rm -f $SCRATCH/image.20
+seq 1 20000 > $SCRATCH/big.txt
+{
+    echo format
+    echo mount
+    echo create
+    echo "copyin $SCRATCH/big.txt 0"
+    echo "stat 0"
+    echo unmount
+} | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null | grep -E 'full|bytes' > $SCRATCH/full.log
+printf "mount\ncopyout 0 $SCRATCH/big.copy\n" | ./bin/sfssh $SCRATCH/image.20 20 > /dev/null 2>&1
+echo -n "Testing copyin on a full disk in $SCRATCH/image.20 ... "
+if diff -u $SCRATCH/full.log <(printf "disk is full.\n61440 bytes copied\ninode 0 has size 61440 bytes.\n") > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/big.copy <(head -c 61440 $SCRATCH/big.txt); then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: every byte reported written survives a flush that fills a fragmented disk
+
+rm -f $SCRATCH/image.20
+{
+    echo format
+    echo mount
+    for i in $(seq 0 13); do echo create; echo "copyin $SCRATCH/block.txt $i"; done
+    for i in $(seq 0 2 12); do echo "remove $i"; done
+    echo create
+    echo "copyin $SCRATCH/big.txt 0"
+    echo unmount
+} | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null | grep 'bytes copied' | tail -n 1 > $SCRATCH/full.log
+COPIED=$(awk '{print $1}' $SCRATCH/full.log)
+printf "mount\ncopyout 0 $SCRATCH/big.copy\n" | ./bin/sfssh $SCRATCH/image.20 20 > /dev/null 2>&1
+echo -n "Testing copyin on a full fragmented disk in $SCRATCH/image.20 ... "
+if [ -n "$COPIED" ] && cmp -s $SCRATCH/big.copy <(head -c $COPIED $SCRATCH/big.txt); then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/full.log
+fi
+
+# Test: zero blocks are copied in as holes and copied out without being written
+
+sparse-debug-output() {
+    cat <<EOF
+Inode 0:
+    size: 1000000 bytes
+    extents: 11-11 hole:145 12-12 hole:97 14-14
+    extent blocks: 13
+EOF
+}
+
+rm -f $SCRATCH/image.100 $SCRATCH/sparse.txt
+truncate -s 1000000 $SCRATCH/sparse.txt
+printf hello | dd of=$SCRATCH/sparse.txt conv=notrunc 2> /dev/null
+printf world | dd of=$SCRATCH/sparse.txt bs=1 seek=600000 conv=notrunc 2> /dev/null
+printf "format\nmount\ncreate\ncopyin $SCRATCH/sparse.txt 0\n" | ./bin/sfssh $SCRATCH/image.100 100 > /dev/null 2>&1
+printf "mount\ncopyout 0 $SCRATCH/sparse.copy\n" | ./bin/sfssh $SCRATCH/image.100 100 > /dev/null 2>&1
+echo -n "Testing copyin of a sparse file in $SCRATCH/image.100 ... "
+if diff -u <(echo debug | ./bin/sfssh $SCRATCH/image.100 100 2> /dev/null | grep -A 3 '^Inode 0:') <(sparse-debug-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/sparse.txt $SCRATCH/sparse.copy &&
+   [ $(du -k $SCRATCH/sparse.copy | awk '{print $1}') -lt 100 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: small files live in their inode and move to blocks once they outgrow it
+
+inline-debug-output() {
+    cat <<EOF
+Inode 0:
+    size: 12 bytes
+    inline data
+Inode 1:
+    size: 28893 bytes
+    extents: 11-18
+EOF
+}
+
+rm -f $SCRATCH/image.100
+printf 'hello world\n' > $SCRATCH/small.txt
+{
+    echo "format inline"
+    echo mount
+    echo create
+    echo "copyin $SCRATCH/small.txt 0"
+    echo create
+    echo "copyin $SCRATCH/small.txt 1"
+    echo "copyin $SCRATCH/seq.txt 1"
+} | ./bin/sfssh $SCRATCH/image.100 100 > /dev/null 2>&1
+printf "mount\ncopyout 0 $SCRATCH/small.copy\ncopyout 1 $SCRATCH/seq.copy\n" | ./bin/sfssh $SCRATCH/image.100 100 > /dev/null 2>&1
+echo -n "Testing copyin of inline files in $SCRATCH/image.100 ... "
+if diff -u <(echo debug | ./bin/sfssh $SCRATCH/image.100 100 2> /dev/null | grep -A 2 '^Inode') <(inline-debug-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/small.txt $SCRATCH/small.copy &&
+   cmp -s $SCRATCH/seq.txt $SCRATCH/seq.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: zero blocks copied over an existing file replace its data
+
+rm -f $SCRATCH/image.20
+head -c 20000 $SCRATCH/seq.txt > $SCRATCH/old.txt
+{ head -c 4096 $SCRATCH/seq.txt; head -c 8192 /dev/zero; head -c 4096 $SCRATCH/seq.txt; } > $SCRATCH/zeros.txt
+{
+    echo format
+    echo mount
+    echo create
+    echo "copyin $SCRATCH/old.txt 0"
+    echo "copyin $SCRATCH/zeros.txt 0"
+    echo "stat 0"
+} | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null | grep 'has size' > $SCRATCH/zeros.log
+printf "mount\ncopyout 0 $SCRATCH/zeros.copy\n" | ./bin/sfssh $SCRATCH/image.20 20 > /dev/null 2>&1
+echo -n "Testing copyin over an existing file in $SCRATCH/image.20 ... "
+if diff -u $SCRATCH/zeros.log <(echo "inode 0 has size 16384 bytes.") > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/zeros.copy $SCRATCH/zeros.txt; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: a smaller file copied over a larger one cuts it off at its own size
+
+printf 'abc' > $SCRATCH/short.txt
+cp data/image.20 $SCRATCH/image.20
+printf "mount\ncopyin $SCRATCH/short.txt 2\nstat 2\n" | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null | grep 'has size' > $SCRATCH/short.log
+printf "mount\ncopyout 2 $SCRATCH/short.copy\n" | ./bin/sfssh $SCRATCH/image.20 20 > /dev/null 2>&1
+rm -f $SCRATCH/image.100
+{
+    echo "format inline"
+    echo mount
+    echo create
+    echo "copyin $SCRATCH/seq.txt 0"
+    echo "copyin $SCRATCH/old.txt 0"
+    echo "stat 0"
+    echo create
+    echo "copyin $SCRATCH/old.txt 1"
+    echo "copyin $SCRATCH/small.txt 1"
+    echo "stat 1"
+} | ./bin/sfssh $SCRATCH/image.100 100 2> /dev/null | grep 'has size' >> $SCRATCH/short.log
+printf "mount\ncopyout 0 $SCRATCH/old.copy\ncopyout 1 $SCRATCH/small.copy\n" | ./bin/sfssh $SCRATCH/image.100 100 > /dev/null 2>&1
+echo -n "Testing copyin of a smaller file over a larger one ... "
+if diff -u $SCRATCH/short.log <(printf "inode 2 has size 3 bytes.\ninode 0 has size 20000 bytes.\ninode 1 has size 12 bytes.\n") > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/short.txt $SCRATCH/short.copy &&
+   cmp -s $SCRATCH/old.txt $SCRATCH/old.copy &&
+   cmp -s $SCRATCH/small.txt $SCRATCH/small.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
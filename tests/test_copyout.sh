@@ -49,3 +49,20 @@ if [ $(md5sum $SCRATCH/1.txt | awk '{print $1}') = '0af623d6d8cb0a514816e17c7386
 else
     echo "Failure"
 fi
+
+# Test: sequential copyout is read ahead and every prefetched block is used
+
+cp data/image.200 $SCRATCH/image.200
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 2> $SCRATCH/stats > /dev/null
+mount
+copyout 9 $SCRATCH/9.txt
+EOF
+
+echo -n "Testing copyout readahead in data/image.200 ... "
+if [ $(md5sum $SCRATCH/9.txt | awk '{print $1}') = 'cc4e48a5fe0ba15b13a98b3fd34b340e' ] &&
+   grep -qx '92 readahead hits' $SCRATCH/stats &&
+   grep -qx '0 readahead wasted' $SCRATCH/stats; then
+    echo "Success"
+else
+    echo "Failure"
+fi
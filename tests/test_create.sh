@@ -19,6 +19,8 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+Fragmentation:
+    1 extents in 1 files (1.00 extents per file)
 disk mounted.
 created inode 0.
 created inode 2.
@@ -537,8 +539,10 @@ Inode 126:
 Inode 127:
     size: 0 bytes
     direct blocks:
-261 disk block reads
-127 disk block writes
+Fragmentation:
+    1 extents in 1 files (1.00 extents per file)
+6 disk block reads
+1 disk block writes
 EOF
 }
 
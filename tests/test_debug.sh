@@ -10,6 +10,8 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+Fragmentation:
+    1 extents in 1 files (1.00 extents per file)
 2 disk block reads
 0 disk block writes
 EOF
@@ -30,6 +32,8 @@ Inode 2:
 Inode 3:
     size: 9546 bytes
     direct blocks: 10 11 12
+Fragmentation:
+    3 extents in 2 files (1.50 extents per file)
 4 disk block reads
 0 disk block writes
 EOF
@@ -55,6 +59,8 @@ Inode 9:
     direct blocks: 22 23 24 25 26
     indirect block: 28
     indirect data blocks: 29 30 31 32 33 34 35 36 37 38 39 40 41 42 43 44 45 46 47 48 76 77 78 79 80 82 83 84 85 86 87 88 89 90 91 92 93 94 95 96 97 98 99 100 101 102 103 104 105 106 107 108 109 110 111 112 113 114 115 116 117 118 119 120 121 122 123 124 125 126 127 128 129 130 131 132 133 134 135 136 137 138 139 140 141 142 143 144 145 146 147 148 149 150 151
+Fragmentation:
+    7 extents in 3 files (2.33 extents per file)
 23 disk block reads
 0 disk block writes
 EOF
@@ -8,8 +8,9 @@ SuperBlock:
     5 blocks
     1 inode blocks
     128 inodes
+    version 1
 2 disk block reads
-5 disk block writes
+2 disk block writes
 EOF
 }
 
@@ -21,8 +22,9 @@ SuperBlock:
     20 blocks
     2 inode blocks
     256 inodes
+    version 1
 3 disk block reads
-20 disk block writes
+2 disk block writes
 EOF
 }
 
@@ -34,8 +36,9 @@ SuperBlock:
     200 blocks
     20 inode blocks
     2560 inodes
+    version 1
 21 disk block reads
-200 disk block writes
+2 disk block writes
 EOF
 }
 
@@ -65,3 +68,117 @@ test-format() {
 test-format data/image.5   5   image-5-output
 test-format data/image.20  20  image-20-output
 test-format data/image.200 200 image-200-output
+
+# Test: lazy inode table, zeroed in the background once mounted
+
+lazy-output() {
+    cat <<EOF
+disk formatted.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    version 1
+1 disk block reads
+2 disk block writes
+EOF
+}
+
+lazy-debug-output() {
+    cat <<EOF
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    version 1
+Inode 0:
+    size: 28893 bytes
+    extents: 21-28
+Fragmentation:
+    1 extents in 1 files (1.00 extents per file)
+EOF
+}
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+cp data/image.200 $SCRATCH/image.200
+seq 1 6000 > $SCRATCH/seq.txt
+echo -n "Testing format lazy on $SCRATCH/image.200 ... "
+printf 'format lazy\ndebug\n' | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null > $SCRATCH/format.log
+printf "mount\ncreate\ncopyin $SCRATCH/seq.txt 0\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+if diff -u $SCRATCH/format.log <(lazy-output) > $SCRATCH/test.log &&
+   diff -u <(echo debug | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v 'disk block') <(lazy-debug-output) >> $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: 64-bit format
+
+format-64-output() {
+    cat <<EOF
+disk formatted.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    1280 inodes
+    version 2
+Inode 0:
+    size: 28893 bytes
+    extents: 21-28
+Fragmentation:
+    1 extents in 1 files (1.00 extents per file)
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+echo -n "Testing format 64 on $SCRATCH/image.200 ... "
+printf "format 64\nmount\ncreate\ncopyin $SCRATCH/seq.txt 0\nunmount\ndebug\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v 'disk block\|disk mounted\|disk unmounted\|created inode\|bytes copied' > $SCRATCH/format.log
+printf "mount\ncopyout 0 $SCRATCH/seq.copy\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+if diff -u $SCRATCH/format.log <(format-64-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/seq.txt $SCRATCH/seq.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: inode density and reserved blocks chosen at format time
+
+format-geometry-output() {
+    cat <<EOF
+disk formatted.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    2 inode blocks
+    256 inodes
+    190 reserved blocks
+    version 1
+disk mounted.
+disk is full.
+20480 bytes copied
+format failed!
+disk formatted.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    7 inode blocks
+    896 inodes
+    version 1
+EOF
+}
+
+echo -n "Testing format geometry on $SCRATCH/image.200 ... "
+printf "format inodes=200,reserved=190\ndebug\nmount\ncreate\ncopyin $SCRATCH/seq.txt 0\nunmount\nformat reserved=200\nformat bytes-per-inode=1024\ndebug\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v 'disk block\|disk unmounted\|created inode' > $SCRATCH/format.log
+if diff -u $SCRATCH/format.log <(format-geometry-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
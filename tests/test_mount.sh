@@ -141,3 +141,130 @@ else
     echo "Failure"
     cat $SCRATCH/test.log
 fi
+
+# Test: clean unmount saves the bitmaps, an unclean image is scanned instead
+
+seq 1 6000 > $SCRATCH/seq.txt
+rm -f $SCRATCH/image.20
+cat <<EOF | ./bin/sfssh $SCRATCH/image.20 20 > /dev/null 2>&1
+format
+mount
+create
+copyin $SCRATCH/seq.txt 0
+unmount
+EOF
+cp $SCRATCH/image.20 $SCRATCH/image.20.unclean
+echo -n -e '\x00' | dd of=$SCRATCH/image.20.unclean bs=1 seek=16 conv=notrunc 2> /dev/null
+
+clean-mount-input() {
+    cat <<EOF
+mount
+stat 0
+EOF
+}
+
+clean-mount-output() {
+    cat <<EOF
+disk mounted.
+inode 0 has size 28893 bytes.
+4 disk block reads
+3 disk block writes
+EOF
+}
+
+unclean-mount-output() {
+    cat <<EOF
+disk mounted.
+inode 0 has size 28893 bytes.
+3 disk block reads
+2 disk block writes
+EOF
+}
+
+echo -n "Testing clean-mount on $SCRATCH/image.20 ... "
+if diff -u <(clean-mount-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null) <(clean-mount-output) > $SCRATCH/test.log &&
+   diff -u <(clean-mount-input | ./bin/sfssh $SCRATCH/image.20.unclean 20 2> /dev/null) <(unclean-mount-output) >> $SCRATCH/test.log &&
+   cmp -s $SCRATCH/image.20 $SCRATCH/image.20.unclean; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: metadata committed before a crash is replayed from the journal at mount
+
+journal-output() {
+    cat <<EOF
+Inode 0:
+    size: 1988895 bytes
+    extents: 206-691
+EOF
+}
+
+seq 1 300000 > $SCRATCH/journal.txt
+echo format | ./bin/sfssh $SCRATCH/image.2048 2048 > /dev/null 2>&1
+# Stay idle past a group commit, then die without unmounting
+(printf "mount\ncreate\ncopyin $SCRATCH/journal.txt 0\n"; sleep 3) | ./bin/sfssh $SCRATCH/image.2048 2048 > /dev/null 2>&1 &
+sleep 2
+kill -9 $! 2> /dev/null
+wait 2> /dev/null
+echo -n "Testing journal replay on $SCRATCH/image.2048 ... "
+if diff -u <(printf "mount\ndebug\ncopyout 0 $SCRATCH/journal.copy\n" | ./bin/sfssh $SCRATCH/image.2048 2048 2> $SCRATCH/journal.err | grep -A 2 '^Inode') <(journal-output) > $SCRATCH/test.log &&
+   grep -q 'replayed 1 journal transactions' $SCRATCH/journal.err &&
+   cmp -s $SCRATCH/journal.txt $SCRATCH/journal.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: a cache too small for the pinned metadata commits early instead of writing it back in place
+
+echo format | ./bin/sfssh $SCRATCH/image.small 2048 > /dev/null 2>&1
+(echo mount; for i in $(seq 1 6000); do echo create; done) | ./bin/sfssh $SCRATCH/image.small 2048 file 32 2> $SCRATCH/small.err > /dev/null
+echo -n "Testing small cache on $SCRATCH/image.small ... "
+if [ $(echo debug | ./bin/sfssh $SCRATCH/image.small 2048 2> /dev/null | grep -c '^Inode') = 6000 ] &&
+   [ $(grep 'journal commits' $SCRATCH/small.err | awk '{print $1}') -ge 3 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    grep -E 'journal|cache' $SCRATCH/small.err
+fi
+
+# Test: a block map too large to pin in a small cache is written in place, after a checkpoint
+
+seq 1 2000 | head -c 4096 > $SCRATCH/sparse.txt
+head -c 4096 /dev/zero >> $SCRATCH/sparse.txt
+for i in $(seq 1 12); do
+    cat $SCRATCH/sparse.txt $SCRATCH/sparse.txt > $SCRATCH/sparse.tmp && mv $SCRATCH/sparse.tmp $SCRATCH/sparse.txt
+done
+printf "format 64\nmount\ncreate\ncopyin $SCRATCH/sparse.txt 0\n" | ./bin/sfssh $SCRATCH/image.sparse 16384 file 32 > /dev/null 2>&1
+printf "mount\ncopyout 0 $SCRATCH/sparse.copy\n" | ./bin/sfssh $SCRATCH/image.sparse 16384 file 32 > /dev/null 2>&1
+echo -n "Testing small cache with a large block map on $SCRATCH/image.sparse ... "
+if cmp -s $SCRATCH/sparse.txt $SCRATCH/sparse.copy; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Test: an image laid out in blocks of another size is not mounted
+
+block-size-output() {
+    cat <<EOF
+SuperBlock:
+    magic number is valid
+    block size 65536 is not supported
+mount failed!
+EOF
+}
+
+echo format | ./bin/sfssh $SCRATCH/image.64k 20 > /dev/null 2>&1
+# BlockSize of the 32-bit superblock, the twelfth word
+printf '\x00\x00\x01\x00' | dd of=$SCRATCH/image.64k bs=1 seek=44 conv=notrunc 2> /dev/null
+echo -n "Testing block size on $SCRATCH/image.64k ... "
+if diff -u <(printf "debug\nmount\n" | ./bin/sfssh $SCRATCH/image.64k 20 2> /dev/null | grep -v 'disk block') <(block-size-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
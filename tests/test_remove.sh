@@ -30,6 +30,8 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+Fragmentation:
+    1 extents in 1 files (1.00 extents per file)
 disk mounted.
 created inode 0.
 created inode 2.
@@ -49,6 +51,8 @@ Inode 2:
 Inode 3:
     size: 0 bytes
     direct blocks:
+Fragmentation:
+    1 extents in 1 files (1.00 extents per file)
 created inode 0.
 removed inode 0.
 remove failed!
@@ -62,8 +66,8 @@ SuperBlock:
 Inode 2:
     size: 0 bytes
     direct blocks:
-25 disk block reads
-8 disk block writes
+8 disk block reads
+2 disk block writes
 EOF
 }
 
@@ -108,6 +112,8 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+Fragmentation:
+    1 extents in 1 files (1.00 extents per file)
 disk mounted.
 965 bytes copied
 created inode 0.
@@ -128,6 +134,8 @@ Inode 1:
 Inode 2:
     size: 965 bytes
     direct blocks: 4
+Fragmentation:
+    3 extents in 3 files (1.00 extents per file)
 removed inode 0.
 SuperBlock:
     magic number is valid
@@ -140,6 +148,8 @@ Inode 1:
 Inode 2:
     size: 965 bytes
     direct blocks: 4
+Fragmentation:
+    2 extents in 2 files (1.00 extents per file)
 created inode 0.
 965 bytes copied
 SuperBlock:
@@ -156,8 +166,10 @@ Inode 1:
 Inode 2:
     size: 965 bytes
     direct blocks: 4
-27 disk block reads
-10 disk block writes
+Fragmentation:
+    3 extents in 3 files (1.00 extents per file)
+11 disk block reads
+6 disk block writes
 EOF
 }
 
@@ -200,6 +212,8 @@ Inode 2:
 Inode 3:
     size: 9546 bytes
     direct blocks: 10 11 12
+Fragmentation:
+    3 extents in 2 files (1.50 extents per file)
 disk mounted.
 27160 bytes copied
 removed inode 3.
@@ -213,6 +227,8 @@ Inode 2:
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
+Fragmentation:
+    2 extents in 1 files (2.00 extents per file)
 created inode 0.
 27160 bytes copied
 SuperBlock:
@@ -230,8 +246,10 @@ Inode 2:
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
-41 disk block reads
-18 disk block writes
+Fragmentation:
+    6 extents in 2 files (3.00 extents per file)
+24 disk block reads
+10 disk block writes
 EOF
 }
 
@@ -15,7 +15,7 @@ disk mounted.
 inode 1 has size 965 bytes.
 stat failed!
 stat failed!
-5 disk block reads
+2 disk block reads
 0 disk block writes
 EOF
 }
@@ -35,7 +35,7 @@ disk mounted.
 stat failed!
 inode 2 has size 27160 bytes.
 inode 3 has size 9546 bytes.
-7 disk block reads
+4 disk block reads
 0 disk block writes
 EOF
 }
@@ -57,7 +57,7 @@ inode 1 has size 1523 bytes.
 inode 2 has size 105421 bytes.
 stat failed!
 inode 9 has size 409305 bytes.
-27 disk block reads
+23 disk block reads
 0 disk block writes
 EOF
 }
@@ -78,3 +78,39 @@ test-stat() {
 test-stat 5
 test-stat 20
 test-stat 200
+
+# Test: stats counts operations and bytes, and reset starts over (cat stats the inode once more)
+
+stats-input() {
+    cat <<EOF
+mount
+stat 1
+stat 2
+cat 1
+stats
+stats reset
+stat 1
+stats
+EOF
+}
+
+stats-output() {
+    cat <<EOF
+stat 3 0
+read 1 965
+mount 1 0
+stats reset.
+stat 1 0
+read 0 0
+mount 0 0
+EOF
+}
+
+echo -n "Testing stats on data/image.5 ... "
+if diff -u <(stats-input | ./bin/sfssh data/image.5 5 2> /dev/null | awk '/^(stat|read|mount) +[0-9]/ {print $1, $2, $3} /^stats reset/') <(stats-output) > test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat test.log
+fi
+rm -f test.log
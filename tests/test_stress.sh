@@ -0,0 +1,57 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: 4 threads on each backend
+
+for backend in file mmap async ram ssd; do
+    echo -n "Testing stress with $backend backend ... "
+    if ./bin/sfsstress $SCRATCH/image.4096 4096 4 $backend > /dev/null 2>&1; then
+	echo "Success"
+    else
+	echo "Failure"
+    fi
+done
+
+# Test: the async backend completes its queued requests itself once io_uring_enter fails
+
+cat > $SCRATCH/enter.c <<SHIM
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+
+// Fail io_uring_enter for good after the first ENTER_CALLS calls
+long syscall(long number, ...) {
+    static long (*real)(long, ...);
+    static long calls;
+    long a[6];
+    va_list ap;
+    va_start(ap, number);
+    for (int i = 0; i < 6; i++) {
+	a[i] = va_arg(ap, long);
+    }
+    va_end(ap);
+    if (number == __NR_io_uring_enter && __atomic_fetch_add(&calls, 1, __ATOMIC_RELAXED) >= atol(getenv("ENTER_CALLS"))) {
+	errno = EBADF;
+	return -1;
+    }
+    if (real == NULL) {
+	real = (long (*)(long, ...))dlsym(RTLD_NEXT, "syscall");
+    }
+    return real(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+SHIM
+if cc -shared -fPIC -o $SCRATCH/enter.so $SCRATCH/enter.c -ldl 2> /dev/null; then
+    for calls in 0 20; do
+	echo -n "Testing stress with async backend failing after $calls submissions ... "
+	if ENTER_CALLS=$calls LD_PRELOAD=$SCRATCH/enter.so ./bin/sfsstress $SCRATCH/image.4096 4096 4 async > /dev/null 2>&1; then
+	    echo "Success"
+	else
+	    echo "Failure"
+	fi
+    done
+fi